@@ -3,17 +3,517 @@
  *
  * See aes-crypt.h and aes-crypt.c for more details
  *
+ * Either path may be "-" for stdin or stdout, so it can sit in a pipeline;
+ * data is streamed through in large blocks with reads, cipher work and
+ * writes overlapped (see do_crypt_stream). A byte count and throughput
+ * summary goes to stderr.
+ *
+ * With -r it converts a whole directory tree instead, files in parallel,
+ * writing encrypted files in the chunked format pa4-encfs stores (see
+ * encfs-chunk.h) and flagging them with user.encrypted, so the output
+ * can be mounted as is. Decrypting only touches files flagged that way,
+ * as pa4-encfs does, and copies the rest.
+ *
  * By Andy Sayler (www.andysayler.com)
  * Created  04/17/12
  * Modified 04/18/12
  *
  */
 
+/* nftw() */
+#define _XOPEN_SOURCE 700
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 
 #include "aes-crypt.h"
+#include "encfs-chunk.h"
+#include "encfs-pool.h"
+#include "encfs-stats.h"
+
+#define XATTR_FLAGS     "user.encrypted"
+#define XATTR_ENCRYPTED "true"
+
+/* Files handed to the worker pool at a time: plenty to keep every worker
+ * busy, while bounding what the walk holds in memory */
+#define TREE_BATCH 4096
+
+/* Seconds between progress lines */
+#define TREE_PROGRESS_SEC 1
+
+/* An output directory and the mode it gets once it is filled in */
+struct tree_dir {
+    char* path;
+    mode_t mode;
+};
+
+/* State of one -r run. nftw() takes no argument for its callback, so
+ * there is only the one. */
+struct tree {
+    int action;
+    char* key_str;
+    int new_mode;
+    struct aes_crypt ciphers[AES_CRYPT_NMODES];
+    const char* in_root;
+    size_t in_len;
+    const char* out_root;
+    struct encfs_pool* pool;
+    char* batch[TREE_BATCH];
+    size_t nbatch;
+    struct tree_dir* dirs;
+    size_t ndirs;
+    size_t dirs_cap;
+    uint64_t start;
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t errors;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static struct tree tree;
+
+/* pwrite() that retries on short transfers and EINTR */
+static int pwrite_all(int fd, const char* buf, size_t len, off_t off){
+    ssize_t res;
+
+    while(len > 0){
+	res = pwrite(fd, buf, len, off);
+	if(res == -1 && errno == EINTR){
+	    continue;
+	}
+	if(res == -1){
+	    return -errno;
+	}
+	buf += res;
+	len -= res;
+	off += res;
+    }
+    return 0;
+}
+
+/* Encrypt the size bytes of in to a fresh chunked file on out,
+ * FD_BLOCKSIZE at a time. A file that shrinks under the walk fails with
+ * -EIO rather than being cut short silently. */
+static int tree_encrypt(struct tree* t, int in, int out, off_t size){
+    struct encfs_key key;
+    char* buf;
+    ssize_t res;
+    ssize_t got;
+    off_t off;
+    size_t n;
+
+    memset(&key, 0, sizeof(key));
+    key.ac = &t->ciphers[t->new_mode];
+    res = encfs_init(out, &key);
+    if(res < 0 || size == 0){
+	return res;
+    }
+
+    buf = malloc(FD_BLOCKSIZE);
+    if(!buf){
+	return -ENOMEM;
+    }
+    posix_fadvise(in, 0, size, POSIX_FADV_SEQUENTIAL);
+    for(off = 0; off < size; off += n){
+	n = size - off < FD_BLOCKSIZE ? size - off : FD_BLOCKSIZE;
+	for(got = 0; got < (ssize_t)n; got += res){
+	    res = pread(in, buf + got, n - got, off + got);
+	    if(res == -1 && errno == EINTR){
+		res = 0;
+		continue;
+	    }
+	    if(res == -1){
+		res = -errno;
+		break;
+	    }
+	    if(res == 0){
+		res = -EIO;
+		break;
+	    }
+	}
+	if(res < 0){
+	    break;
+	}
+	res = encfs_pwrite(out, buf, n, off, &key);
+	if(res < 0){
+	    break;
+	}
+	__atomic_fetch_add(&t->bytes, n, __ATOMIC_RELAXED);
+    }
+    free(buf);
+    return res < 0 ? res : 0;
+}
+
+/* Decrypt the chunked or legacy CBC file on in to out */
+static int tree_decrypt(struct tree* t, int in, int out){
+    struct encfs_key key;
+    char* buf;
+    ssize_t res;
+    ssize_t n;
+    off_t off = 0;
+    int mode;
+
+    memset(&key, 0, sizeof(key));
+    res = encfs_probe(in, &mode, &key);
+    if(res == ENCFS_FMT_LEGACY){
+	return do_crypt_fd(in, out, 0, t->key_str) ? 0 : -EIO;
+    }
+    if(res != ENCFS_FMT_CHUNKED){
+	return res;
+    }
+    /* Files in a mode that failed to set up are skipped as errors */
+    if(!t->ciphers[mode].ctx){
+	return -EIO;
+    }
+    key.ac = &t->ciphers[mode];
+
+    buf = malloc(FD_BLOCKSIZE);
+    if(!buf){
+	return -ENOMEM;
+    }
+    res = 0;
+    while((n = encfs_pread(in, buf, FD_BLOCKSIZE, off, &key)) > 0){
+	res = pwrite_all(out, buf, n, off);
+	if(res < 0){
+	    break;
+	}
+	off += n;
+	__atomic_fetch_add(&t->bytes, n, __ATOMIC_RELAXED);
+    }
+    if(n < 0){
+	res = n;
+    }
+    free(buf);
+    return res;
+}
+
+/* Whether the file open on fd is flagged as encrypted */
+static int tree_flagged(int fd){
+    char value[sizeof(XATTR_ENCRYPTED)];
+    ssize_t len;
+
+    len = fgetxattr(fd, XATTR_FLAGS, value, sizeof(value));
+    return len == 4 && !memcmp(value, XATTR_ENCRYPTED, 4);
+}
+
+/* Convert one regular file: the pool's work item */
+static void tree_file(void* arg, size_t i){
+    struct tree* t = arg;
+    char in_path[PATH_MAX];
+    char out_path[PATH_MAX];
+    struct stat st;
+    int in;
+    int out;
+    int res;
+
+    snprintf(in_path, sizeof(in_path), "%s%s", t->in_root, t->batch[i]);
+    snprintf(out_path, sizeof(out_path), "%s%s", t->out_root, t->batch[i]);
+
+    in = open(in_path, O_RDONLY);
+    if(in == -1){
+	res = -errno;
+	goto out;
+    }
+    if(fstat(in, &st) == -1){
+	res = -errno;
+	close(in);
+	goto out;
+    }
+    out = open(out_path, O_RDWR | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    if(out == -1){
+	res = -errno;
+	close(in);
+	goto out;
+    }
+
+    if(t->action == 1){
+	res = tree_encrypt(t, in, out, st.st_size);
+	if(res == 0 &&
+	   fsetxattr(out, XATTR_FLAGS, XATTR_ENCRYPTED, 4, 0) == -1){
+	    res = -errno;
+	}
+    }
+    else if(t->action == 0 && tree_flagged(in)){
+	res = tree_decrypt(t, in, out);
+    }
+    else{
+	res = do_crypt_fd(in, out, -1, NULL) ? 0 : -EIO;
+	if(res == 0){
+	    __atomic_fetch_add(&t->bytes, st.st_size, __ATOMIC_RELAXED);
+	}
+    }
+
+    close(in);
+    if(close(out) == -1 && res == 0){
+	res = -errno;
+    }
+    if(res < 0){
+	unlink(out_path);
+    }
+
+out:
+    if(res < 0){
+	fprintf(stderr, "%s: %s\n", in_path, strerror(-res));
+	__atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+    }
+    else{
+	__atomic_fetch_add(&t->files, 1, __ATOMIC_RELAXED);
+    }
+    free(t->batch[i]);
+}
+
+/* Convert the files collected so far */
+static void tree_flush(struct tree* t){
+    encfs_pool_run(t->pool, tree_file, t, t->nbatch);
+    t->nbatch = 0;
+}
+
+/* Remember the output directory at out_path for tree_chmod() */
+static int tree_add_dir(struct tree* t, const char* out_path, mode_t mode){
+    struct tree_dir* dirs;
+
+    if(t->ndirs == t->dirs_cap){
+	t->dirs_cap = t->dirs_cap ? t->dirs_cap * 2 : 64;
+	dirs = realloc(t->dirs, t->dirs_cap * sizeof(*dirs));
+	if(!dirs){
+	    return -1;
+	}
+	t->dirs = dirs;
+    }
+    t->dirs[t->ndirs].path = strdup(out_path);
+    if(!t->dirs[t->ndirs].path){
+	return -1;
+    }
+    t->dirs[t->ndirs++].mode = mode;
+    return 0;
+}
+
+/* Give every output directory its source's mode, once nothing more is
+ * written into them. Directories were met parents first, so going
+ * backwards reaches each one while its parents can still be searched. */
+static void tree_chmod(struct tree* t){
+    size_t i = t->ndirs;
+
+    while(i-- > 0){
+	if(chmod(t->dirs[i].path, t->dirs[i].mode) == -1){
+	    perror(t->dirs[i].path);
+	    __atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+	}
+	free(t->dirs[i].path);
+    }
+    free(t->dirs);
+}
+
+/* nftw() callback: recreate directories and symlinks as they are met and
+ * queue regular files. Directories are created writable and only get
+ * their own mode back from tree_chmod(). */
+static int tree_visit(const char* path, const struct stat* st, int type,
+		      struct FTW* ftw){
+    struct tree* t = &tree;
+    char out_path[PATH_MAX];
+    char target[PATH_MAX];
+    ssize_t len;
+
+    (void)ftw;
+
+    snprintf(out_path, sizeof(out_path), "%s%s", t->out_root,
+	     path + t->in_len);
+    switch(type){
+    case FTW_D:
+	if(mkdir(out_path, (st->st_mode & 07777) | S_IRWXU) == -1 &&
+	   errno != EEXIST){
+	    perror(out_path);
+	    __atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+	    break;
+	}
+	if(tree_add_dir(t, out_path, st->st_mode & 07777) == -1){
+	    perror("tree_add_dir");
+	    return -1;
+	}
+	break;
+    case FTW_SL:
+	len = readlink(path, target, sizeof(target) - 1);
+	if(len == -1){
+	    perror(path);
+	    __atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+	    break;
+	}
+	target[len] = '\0';
+	if(symlink(target, out_path) == -1 && errno != EEXIST){
+	    perror(out_path);
+	    __atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+	}
+	break;
+    case FTW_F:
+	if(!S_ISREG(st->st_mode)){
+	    fprintf(stderr, "%s: not a regular file, skipped\n", path);
+	    break;
+	}
+	t->batch[t->nbatch] = strdup(path + t->in_len);
+	if(!t->batch[t->nbatch]){
+	    perror("strdup");
+	    return -1;
+	}
+	if(++t->nbatch == TREE_BATCH){
+	    tree_flush(t);
+	}
+	break;
+    default:
+	fprintf(stderr, "%s: cannot read\n", path);
+	__atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/* Print files, bytes and throughput so far, ending the line with end */
+static void tree_report(struct tree* t, const char* end){
+    double secs = (encfs_stats_now() - t->start) / 1e9;
+    uint64_t bytes = __atomic_load_n(&t->bytes, __ATOMIC_RELAXED);
+
+    fprintf(stderr, "%llu files, %llu errors, %.1f MB in %.1f s, %.1f MB/s%s",
+	    (unsigned long long)__atomic_load_n(&t->files, __ATOMIC_RELAXED),
+	    (unsigned long long)__atomic_load_n(&t->errors, __ATOMIC_RELAXED),
+	    bytes / 1e6, secs, secs > 0 ? bytes / 1e6 / secs : 0.0, end);
+}
+
+/* Rewrite the progress line every TREE_PROGRESS_SEC until t->stop */
+static void* tree_progress(void* arg){
+    struct tree* t = arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&t->lock);
+    while(!t->stop){
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += TREE_PROGRESS_SEC;
+	pthread_cond_timedwait(&t->cond, &t->lock, &ts);
+	if(!t->stop){
+	    tree_report(t, "\r");
+	}
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+static void tree_usage(const char* prog){
+    fprintf(stderr, "usage: %s -r %s\n", prog,
+	    "[-j <threads>] [-m <cipher>] -e|-d|-c [<key phrase>]"
+	    " <in dir> <out dir>");
+    exit(EXIT_FAILURE);
+}
+
+/* aes-crypt-util -r: convert the tree at in dir into out dir */
+static int tree_main(int argc, char** argv){
+    struct tree* t = &tree;
+    pthread_t progress;
+    int progress_on = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int hw_aes = aes_crypt_hw_aes();
+    int action = -2;
+    int opt;
+    int i;
+
+    /* Options follow the -r in argv[1] */
+    t->new_mode = hw_aes == 0 ? AES_CRYPT_CHACHA20_POLY1305 : AES_CRYPT_GCM;
+    optind = 2;
+    while((opt = getopt(argc, argv, "j:m:edc")) != -1){
+	switch(opt){
+	case 'j':
+	    threads = atoi(optarg);
+	    break;
+	case 'm':
+	    t->new_mode = aes_crypt_mode(optarg);
+	    if(t->new_mode < 0){
+		fprintf(stderr, "unknown cipher %s\n", optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'e':
+	    action = 1;
+	    break;
+	case 'd':
+	    action = 0;
+	    break;
+	case 'c':
+	    action = -1;
+	    break;
+	default:
+	    tree_usage(argv[0]);
+	}
+    }
+    if(action == -2 || threads < 1 ||
+       argc - optind != (action >= 0 ? 3 : 2)){
+	tree_usage(argv[0]);
+    }
+    t->action = action;
+    if(action >= 0){
+	t->key_str = argv[optind++];
+	for(i = 0; i < AES_CRYPT_NMODES; i++){
+	    if(aes_crypt_init(&t->ciphers[i], t->key_str, i)){
+		continue;
+	    }
+	    if(action == 1 && i == t->new_mode){
+		fprintf(stderr, "cipher setup failed\n");
+		exit(EXIT_FAILURE);
+	    }
+	    fprintf(stderr, "cipher %d unavailable, files using it will "
+		    "fail with EIO\n", i);
+	}
+    }
+    t->in_root = argv[optind];
+    t->in_len = strlen(t->in_root);
+    t->out_root = argv[optind + 1];
+
+    /* The calling thread works through each batch as well */
+    if(threads > 1){
+	t->pool = encfs_pool_new(threads - 1);
+	if(!t->pool){
+	    perror("encfs_pool_new");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    t->start = encfs_stats_now();
+    if(isatty(STDERR_FILENO) &&
+       !pthread_create(&progress, NULL, tree_progress, t)){
+	progress_on = 1;
+    }
+
+    if(nftw(t->in_root, tree_visit, 64, FTW_PHYS) == -1){
+	perror(t->in_root);
+	__atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+    }
+    tree_flush(t);
+    tree_chmod(t);
+
+    if(progress_on){
+	pthread_mutex_lock(&t->lock);
+	t->stop = 1;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	pthread_join(progress, NULL);
+    }
+    tree_report(t, "\n");
+
+    encfs_pool_free(t->pool);
+    if(action >= 0){
+	for(i = 0; i < AES_CRYPT_NMODES; i++){
+	    aes_crypt_cleanup(&t->ciphers[i]);
+	}
+    }
+    return t->errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
 int main(int argc, char **argv)
 {
@@ -22,14 +522,27 @@ int main(int argc, char **argv)
     int action = 0;
     int ifarg;
     int ofarg;
-    FILE* inFile = NULL;
-    FILE* outFile = NULL;
+    int inFd;
+    int outFd;
+    off_t inBytes;
+    off_t outBytes;
+    uint64_t start;
+    double secs;
+    int status = EXIT_SUCCESS;
     char* key_str = NULL;
 
+    /* Tree Case */
+    if(argc > 1 && !strcmp(argv[1], "-r")){
+	return tree_main(argc, argv);
+    }
+
     /* Check General Input */
     if(argc < 3){
 	fprintf(stderr, "usage: %s %s\n", argv[0],
 		"<type> <opt key phrase> <in path> <out path>");
+	fprintf(stderr, "       %s -r %s\n", argv[0],
+		"[-j <threads>] [-m <cipher>] <type> <opt key phrase>"
+		" <in dir> <out dir>");
 	exit(EXIT_FAILURE);
     }
 
@@ -81,30 +594,49 @@ int main(int argc, char **argv)
 	exit(EXIT_FAILURE);
     }
 
-    /* Open Files */
-    inFile = fopen(argv[ifarg], "rb");
-    if(!inFile){
-	perror("infile fopen error");
-	return EXIT_FAILURE;
+    /* Open Files ("-" is stdin or stdout) */
+    if(!strcmp(argv[ifarg], "-")){
+	inFd = STDIN_FILENO;
+    }
+    else{
+	inFd = open(argv[ifarg], O_RDONLY);
+	if(inFd == -1){
+	    perror("infile open error");
+	    return EXIT_FAILURE;
+	}
     }
-    outFile = fopen(argv[ofarg], "wb+");
-    if(!outFile){
-	perror("outfile fopen error");
-	return EXIT_FAILURE;
+    if(!strcmp(argv[ofarg], "-")){
+	outFd = STDOUT_FILENO;
+    }
+    else{
+	outFd = open(argv[ofarg], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(outFd == -1){
+	    perror("outfile open error");
+	    return EXIT_FAILURE;
+	}
     }
 
-    /* Perform do_crpt action (encrypt, decrypt, copy) */
-    if(!do_crypt(inFile, outFile, action, key_str)){
+    /* Perform do_crypt action (encrypt, decrypt, copy) */
+    start = encfs_stats_now();
+    if(!do_crypt_stream(inFd, outFd, action, key_str, &inBytes, &outBytes)){
 	fprintf(stderr, "do_crypt failed\n");
+	status = EXIT_FAILURE;
     }
+    secs = (encfs_stats_now() - start) / 1e9;
 
     /* Cleanup */
-    if(fclose(outFile)){
-        perror("outFile fclose error\n");
+    if(close(outFd)){
+	perror("outFd close error");
+	status = EXIT_FAILURE;
     }
-    if(fclose(inFile)){
-	perror("inFile fclose error\n");
+    if(close(inFd)){
+	perror("inFd close error");
     }
 
-    return EXIT_SUCCESS;
+    /* Summary, on stderr since stdout may be the data */
+    fprintf(stderr, "%lld bytes in, %lld bytes out in %.1f s, %.1f MB/s\n",
+	    (long long)inBytes, (long long)outBytes, secs,
+	    secs > 0 ? inBytes / 1e6 / secs : 0.0);
+
+    return status;
 }
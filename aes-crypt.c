@@ -15,12 +15,34 @@
  *
  */
 
+/* splice() and F_SETPIPE_SZ */
+#define _GNU_SOURCE
+
 #include "aes-crypt.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+
 #define BLOCKSIZE 1024
 #define FAILURE 0
 #define SUCCESS 1
 
+/* Blocks do_crypt_stream keeps in flight per stage: one being worked on,
+ * one waiting for the next stage and one for the previous to refill */
+#define STREAM_SLOTS 3
+
+/* Pipe buffer size do_crypt_stream asks for, the default limit for
+ * unprivileged processes (/proc/sys/fs/pipe-max-size) */
+#define STREAM_PIPE_SIZE (1024 * 1024)
+
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     /* Local Vars */
 
@@ -33,7 +55,7 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     int writelen;
 
     /* OpenSSL libcrypto vars */
-    EVP_CIPHER_CTX ctx;
+    EVP_CIPHER_CTX* ctx = NULL;
     unsigned char key[32];
     unsigned char iv[32];
     int nrounds = 5;
@@ -57,8 +79,12 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	    return 0;
 	}
 	/* Init Engine */
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_CipherInit_ex(&ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
+	ctx = EVP_CIPHER_CTX_new();
+	if(!ctx){
+	    /* Error */
+	    return 0;
+	}
+	EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
     }    
 
     /* Loop through Input File*/
@@ -72,10 +98,10 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	
 	/* If in cipher mode, perform cipher transform on block */
 	if(action >= 0){
-	    if(!EVP_CipherUpdate(&ctx, outbuf, &outlen, inbuf, inlen))
+	    if(!EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, inlen))
 		{
 		    /* Error */
-		    EVP_CIPHER_CTX_cleanup(&ctx);
+		    EVP_CIPHER_CTX_free(ctx);
 		    return 0;
 		}
 	}
@@ -90,7 +116,7 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	if(writelen != outlen){
 	    /* Error */
 	    perror("fwrite error");
-	    EVP_CIPHER_CTX_cleanup(&ctx);
+	    EVP_CIPHER_CTX_free(ctx);
 	    return 0;
 	}
     }
@@ -98,17 +124,904 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     /* If in cipher mode, handle necessary padding */
     if(action >= 0){
 	/* Handle remaining cipher block + padding */
-	if(!EVP_CipherFinal_ex(&ctx, outbuf, &outlen))
+	if(!EVP_CipherFinal_ex(ctx, outbuf, &outlen))
 	    {
 		/* Error */
-		EVP_CIPHER_CTX_cleanup(&ctx);
+		EVP_CIPHER_CTX_free(ctx);
 		return 0;
 	    }
 	/* Write remainign cipher block + padding*/
 	fwrite(outbuf, sizeof(*inbuf), outlen, out);
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	EVP_CIPHER_CTX_free(ctx);
     }
     
     /* Success */
     return 1;
 }
+
+/* write() that retries on short transfers and EINTR */
+static int write_full(int fd, const unsigned char* buf, int len){
+    int done = 0;
+    ssize_t res;
+
+    while(done < len){
+	res = write(fd, buf + done, len - done);
+	if(res == -1){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    return 0;
+	}
+	done += res;
+    }
+    return 1;
+}
+
+/* The whole-file CBC engine do_crypt uses, keyed from key_str for
+ * action (1=encrypt, 0=decrypt), or NULL on error */
+static EVP_CIPHER_CTX* cbc_ctx(char* key_str, int action){
+    EVP_CIPHER_CTX* ctx;
+    unsigned char key[32];
+    unsigned char iv[32];
+    int nrounds = 5;
+
+    if(!key_str){
+	/* Error */
+	fprintf(stderr, "Key_str must not be NULL\n");
+	return NULL;
+    }
+    /* Build Key from String */
+    if(EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
+		      (unsigned char*)key_str, strlen(key_str), nrounds,
+		      key, iv) != 32){
+	/* Error */
+	fprintf(stderr, "Key derivation failed\n");
+	return NULL;
+    }
+    /* Init Engine */
+    ctx = EVP_CIPHER_CTX_new();
+    if(ctx){
+	EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(iv, sizeof(iv));
+    return ctx;
+}
+
+extern int do_crypt_fd(int in, int out, int action, char* key_str){
+    /* Local Vars */
+
+    /* Buffers */
+    unsigned char* inbuf;
+    ssize_t inlen;
+    /* Allow enough space in output buffer for additional cipher block */
+    unsigned char* outbuf;
+    int outlen;
+
+    /* OpenSSL libcrypto vars */
+    EVP_CIPHER_CTX* ctx = NULL;
+    int ok = 1;
+
+    /* Setup Encryption Key and Cipher Engine if in cipher mode */
+    if(action >= 0){
+	ctx = cbc_ctx(key_str, action);
+	if(!ctx){
+	    return FAILURE;
+	}
+    }
+
+    inbuf = malloc(FD_BLOCKSIZE);
+    outbuf = malloc(FD_BLOCKSIZE + EVP_MAX_BLOCK_LENGTH);
+    if(!inbuf || !outbuf){
+	ok = 0;
+    }
+
+    /* Loop through Input File*/
+    while(ok){
+	/* Read Block */
+	inlen = read(in, inbuf, FD_BLOCKSIZE);
+	if(inlen == -1 && errno == EINTR){
+	    continue;
+	}
+	if(inlen == -1){
+	    perror("read error");
+	    ok = 0;
+	    break;
+	}
+	if(inlen == 0){
+	    /* EOF -> Break Loop */
+	    break;
+	}
+
+	/* If in cipher mode, perform cipher transform on block */
+	if(action >= 0){
+	    ok = EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, inlen) &&
+		write_full(out, outbuf, outlen);
+	}
+	/* If in pass-through mode, write block as is */
+	else{
+	    ok = write_full(out, inbuf, inlen);
+	}
+    }
+
+    /* If in cipher mode, handle remaining cipher block + padding */
+    if(ok && action >= 0){
+	ok = EVP_CipherFinal_ex(ctx, outbuf, &outlen) &&
+	    write_full(out, outbuf, outlen);
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    free(inbuf);
+    free(outbuf);
+
+    return ok ? SUCCESS : FAILURE;
+}
+
+/* do_crypt_stream moves data through two rings of STREAM_SLOTS buffers:
+ * a reader thread fills the first from in, the calling thread ciphers
+ * each block into the second, and a writer thread drains that to out.
+ * The producer of a ring fills slot put % STREAM_SLOTS once the consumer
+ * has handed it back; the consumer takes slot got % STREAM_SLOTS once it
+ * has been filled. Both rings share the stream's lock. */
+struct stream_ring {
+    unsigned char* buf[STREAM_SLOTS];
+    size_t len[STREAM_SLOTS];
+    unsigned long put;
+    unsigned long got;
+    int eof;
+};
+
+struct stream {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int failed;
+    int in;
+    int out;
+    off_t in_bytes;
+    off_t out_bytes;
+    struct stream_ring rd;
+    struct stream_ring wr;
+};
+
+/* Give up on the stream, waking every thread waiting on it */
+static void stream_fail(struct stream* s){
+    pthread_mutex_lock(&s->lock);
+    __atomic_store_n(&s->failed, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Producer: the next slot of r to fill, or NULL if the stream failed */
+static unsigned char* ring_fill(struct stream* s, struct stream_ring* r){
+    unsigned char* buf = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    while(r->put - r->got >= STREAM_SLOTS && !s->failed){
+	pthread_cond_wait(&s->cond, &s->lock);
+    }
+    if(!s->failed){
+	buf = r->buf[r->put % STREAM_SLOTS];
+    }
+    pthread_mutex_unlock(&s->lock);
+    return buf;
+}
+
+/* Producer: pass on the slot from ring_fill() holding len bytes, or with
+ * len 0 mark the end of the data */
+static void ring_put(struct stream* s, struct stream_ring* r, size_t len){
+    pthread_mutex_lock(&s->lock);
+    if(len){
+	r->len[r->put % STREAM_SLOTS] = len;
+	r->put++;
+    }
+    else{
+	r->eof = 1;
+    }
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Consumer: the next filled slot of r and its length, or NULL at the end
+ * of the data or if the stream failed */
+static unsigned char* ring_take(struct stream* s, struct stream_ring* r,
+				size_t* len){
+    unsigned char* buf = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    while(r->got == r->put && !r->eof && !s->failed){
+	pthread_cond_wait(&s->cond, &s->lock);
+    }
+    if(!s->failed && r->got != r->put){
+	buf = r->buf[r->got % STREAM_SLOTS];
+	*len = r->len[r->got % STREAM_SLOTS];
+    }
+    pthread_mutex_unlock(&s->lock);
+    return buf;
+}
+
+/* Consumer: hand the slot from ring_take() back to the producer */
+static void ring_done(struct stream* s, struct stream_ring* r){
+    pthread_mutex_lock(&s->lock);
+    r->got++;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Drain r to s->out until the end of the data; 1 on success */
+static int stream_drain(struct stream* s, struct stream_ring* r){
+    unsigned char* buf;
+    size_t len;
+
+    while((buf = ring_take(s, r, &len))){
+	if(!write_full(s->out, buf, len)){
+	    perror("write error");
+	    stream_fail(s);
+	    return 0;
+	}
+	s->out_bytes += len;
+	ring_done(s, r);
+    }
+    return 1;
+}
+
+/* Fill s->rd from s->in, STREAM_BLOCKSIZE at a time. A pipe hands out at
+ * most a pipe buffer per read(), so each block takes as many as needed.
+ * Once the stream has failed the reader stops at its next read(); one
+ * already blocked waits for input or EOF first, so a failure on a quiet
+ * input pipe only returns once its writer sends more or closes it. */
+static void* stream_reader(void* arg){
+    struct stream* s = arg;
+    unsigned char* buf;
+    size_t len;
+    ssize_t res;
+
+    while((buf = ring_fill(s, &s->rd))){
+	for(len = 0; len < STREAM_BLOCKSIZE; len += res){
+	    if(__atomic_load_n(&s->failed, __ATOMIC_RELAXED)){
+		return NULL;
+	    }
+	    res = read(s->in, buf + len, STREAM_BLOCKSIZE - len);
+	    if(res == -1 && errno == EINTR){
+		res = 0;
+		continue;
+	    }
+	    if(res <= 0){
+		break;
+	    }
+	}
+	if(res == -1){
+	    perror("read error");
+	    stream_fail(s);
+	    return NULL;
+	}
+	s->in_bytes += len;
+	if(len){
+	    ring_put(s, &s->rd, len);
+	}
+	if(len < STREAM_BLOCKSIZE){
+	    break;
+	}
+    }
+    ring_put(s, &s->rd, 0);
+    return NULL;
+}
+
+static void* stream_writer(void* arg){
+    struct stream* s = arg;
+
+    stream_drain(s, &s->wr);
+    return NULL;
+}
+
+/* Copy in to out with splice() when one of them is a pipe, so the data
+ * never enters user space. Returns 1 if done, 0 if splice() does not
+ * apply to these files and nothing was moved, -1 on error. */
+static int stream_splice(int in, int out, off_t* bytes){
+    struct stat in_st;
+    struct stat out_st;
+    ssize_t res;
+
+    if(fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1 ||
+       (!S_ISFIFO(in_st.st_mode) && !S_ISFIFO(out_st.st_mode))){
+	return 0;
+    }
+    for(;;){
+	res = splice(in, NULL, out, NULL, STREAM_BLOCKSIZE,
+		     SPLICE_F_MOVE | SPLICE_F_MORE);
+	if(res == -1 && errno == EINTR){
+	    continue;
+	}
+	if(res == -1){
+	    if(*bytes == 0 && errno == EINVAL){
+		return 0;
+	    }
+	    perror("splice error");
+	    return -1;
+	}
+	if(res == 0){
+	    return 1;
+	}
+	*bytes += res;
+    }
+}
+
+extern int do_crypt_stream(int in, int out, int action, char* key_str,
+			   off_t* in_bytes, off_t* out_bytes){
+    struct stream s;
+    EVP_CIPHER_CTX* ctx = NULL;
+    pthread_t reader;
+    pthread_t writer;
+    unsigned char* inbuf;
+    unsigned char* outbuf;
+    size_t inlen;
+    int outlen;
+    int ok = 1;
+    int i;
+
+    *in_bytes = 0;
+    *out_bytes = 0;
+
+    /* Pass-through between pipes needs no copies at all */
+    if(action < 0){
+	i = stream_splice(in, out, in_bytes);
+	if(i){
+	    *out_bytes = *in_bytes;
+	    return i > 0 ? SUCCESS : FAILURE;
+	}
+    }
+
+    /* Bigger pipe buffers mean fewer wakeups per block; pipes that cannot
+     * grow (or are not pipes) are left alone */
+    fcntl(in, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+    fcntl(out, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+
+    if(action >= 0){
+	ctx = cbc_ctx(key_str, action);
+	if(!ctx){
+	    return FAILURE;
+	}
+    }
+
+    memset(&s, 0, sizeof(s));
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    s.in = in;
+    s.out = out;
+    for(i = 0; i < STREAM_SLOTS; i++){
+	s.rd.buf[i] = malloc(STREAM_BLOCKSIZE);
+	/* Allow enough space in output buffer for additional cipher block */
+	s.wr.buf[i] = action >= 0 ?
+	    malloc(STREAM_BLOCKSIZE + EVP_MAX_BLOCK_LENGTH) : NULL;
+	if(!s.rd.buf[i] || (action >= 0 && !s.wr.buf[i])){
+	    ok = 0;
+	}
+    }
+    if(ok && pthread_create(&reader, NULL, stream_reader, &s)){
+	ok = 0;
+    }
+    if(!ok){
+	goto out;
+    }
+
+    /* Pass-through: write straight from the read buffers */
+    if(action < 0){
+	ok = stream_drain(&s, &s.rd);
+	pthread_join(reader, NULL);
+	goto out;
+    }
+
+    if(pthread_create(&writer, NULL, stream_writer, &s)){
+	stream_fail(&s);
+	pthread_join(reader, NULL);
+	ok = 0;
+	goto out;
+    }
+    while(ok && (inbuf = ring_take(&s, &s.rd, &inlen))){
+	outbuf = ring_fill(&s, &s.wr);
+	ok = outbuf && EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, inlen);
+	ring_done(&s, &s.rd);
+	if(ok && outlen){
+	    ring_put(&s, &s.wr, outlen);
+	}
+    }
+    /* A failed block leaves the reader waiting for slots that will never
+     * come back, so fail the stream before waiting for it */
+    if(!ok){
+	stream_fail(&s);
+    }
+    pthread_join(reader, NULL);
+
+    /* Handle remaining cipher block + padding */
+    if(ok){
+	outbuf = ring_fill(&s, &s.wr);
+	ok = outbuf && EVP_CipherFinal_ex(ctx, outbuf, &outlen);
+	if(ok && outlen){
+	    ring_put(&s, &s.wr, outlen);
+	}
+    }
+    if(!ok){
+	stream_fail(&s);
+    }
+    ring_put(&s, &s.wr, 0);
+    pthread_join(writer, NULL);
+
+out:
+    ok = ok && !s.failed;
+    for(i = 0; i < STREAM_SLOTS; i++){
+	free(s.rd.buf[i]);
+	free(s.wr.buf[i]);
+    }
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+    EVP_CIPHER_CTX_free(ctx);
+    *in_bytes = s.in_bytes;
+    *out_bytes = s.out_bytes;
+    return ok ? SUCCESS : FAILURE;
+}
+
+/* One thread's copies of an aes_crypt's engine and GMAC, on its copies
+ * list so aes_crypt_cleanup() can free those of threads still alive */
+struct aes_crypt_copy {
+    struct aes_crypt* ac;
+    EVP_CIPHER_CTX* ctx;
+    EVP_CIPHER_CTX* dctx;
+    EVP_MAC_CTX* mac;
+    struct aes_crypt_copy* next;
+    struct aes_crypt_copy** pprev;
+};
+
+static void free_copy(struct aes_crypt_copy* copy){
+    EVP_CIPHER_CTX_free(copy->ctx);
+    EVP_CIPHER_CTX_free(copy->dctx);
+    EVP_MAC_CTX_free(copy->mac);
+    free(copy);
+}
+
+/* Thread exit: take the copy off the list and free it */
+static void free_thread_copy(void* arg){
+    struct aes_crypt_copy* copy = arg;
+    struct aes_crypt* ac = copy->ac;
+
+    pthread_mutex_lock(&ac->copies_lock);
+    *copy->pprev = copy->next;
+    if(copy->next){
+	copy->next->pprev = copy->pprev;
+    }
+    pthread_mutex_unlock(&ac->copies_lock);
+    free_copy(copy);
+}
+
+/* This thread's (so far empty) copy, created on first use. ac->tls is
+ * only a live key while ac->ctx is set, so a mode that failed to set up
+ * (or was cleaned up) fails here before touching it. */
+static struct aes_crypt_copy* thread_copy(struct aes_crypt* ac){
+    struct aes_crypt_copy* copy;
+
+    if(!ac->ctx){
+	return NULL;
+    }
+    copy = pthread_getspecific(ac->tls);
+    if(!copy){
+	copy = calloc(1, sizeof(*copy));
+	if(!copy || pthread_setspecific(ac->tls, copy)){
+	    free(copy);
+	    return NULL;
+	}
+	copy->ac = ac;
+	pthread_mutex_lock(&ac->copies_lock);
+	copy->next = ac->copies;
+	copy->pprev = &ac->copies;
+	if(ac->copies){
+	    ac->copies->pprev = &copy->next;
+	}
+	ac->copies = copy;
+	pthread_mutex_unlock(&ac->copies_lock);
+    }
+    return copy;
+}
+
+/* This thread's copy of the engine keyed for action (ac->dctx when
+ * decrypting XTS, ac->ctx otherwise), created on first use */
+static EVP_CIPHER_CTX* thread_ctx(struct aes_crypt* ac, int action){
+    struct aes_crypt_copy* copy = thread_copy(ac);
+    EVP_CIPHER_CTX** ctx;
+    EVP_CIPHER_CTX* src;
+
+    if(!copy){
+	return NULL;
+    }
+    if(!action && ac->dctx){
+	ctx = &copy->dctx;
+	src = ac->dctx;
+    }
+    else{
+	ctx = &copy->ctx;
+	src = ac->ctx;
+    }
+    if(!*ctx){
+	*ctx = EVP_CIPHER_CTX_new();
+	if(!*ctx || !EVP_CIPHER_CTX_copy(*ctx, src)){
+	    EVP_CIPHER_CTX_free(*ctx);
+	    *ctx = NULL;
+	}
+    }
+    return *ctx;
+}
+
+/* This thread's copy of the keyed GMAC, created on first use */
+static EVP_MAC_CTX* thread_mac(struct aes_crypt* ac){
+    struct aes_crypt_copy* copy = thread_copy(ac);
+
+    if(!copy){
+	return NULL;
+    }
+    if(!copy->mac){
+	copy->mac = EVP_MAC_CTX_dup(ac->mac);
+    }
+    return copy->mac;
+}
+
+/* Key ac->mac with SHA-256 of a label and the cipher key, so the MAC key
+ * is never used as a cipher key */
+static int mac_init(struct aes_crypt* ac){
+    static const char label[] = "pa4-encfs chunk mac";
+    unsigned char mac_key[32];
+    unsigned int key_len;
+    OSSL_PARAM params[2];
+    EVP_MD_CTX* md;
+    EVP_MAC* gmac;
+    int ok;
+
+    md = EVP_MD_CTX_new();
+    ok = md && EVP_DigestInit_ex(md, EVP_sha256(), NULL) &&
+	EVP_DigestUpdate(md, label, sizeof(label) - 1) &&
+	EVP_DigestUpdate(md, ac->key, sizeof(ac->key)) &&
+	EVP_DigestFinal_ex(md, mac_key, &key_len);
+    EVP_MD_CTX_free(md);
+
+    gmac = EVP_MAC_fetch(NULL, "GMAC", NULL);
+    ac->mac = gmac ? EVP_MAC_CTX_new(gmac) : NULL;
+    EVP_MAC_free(gmac);
+
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_CIPHER,
+						 (char*)"AES-256-GCM", 0);
+    params[1] = OSSL_PARAM_construct_end();
+    ok = ok && ac->mac &&
+	EVP_MAC_init(ac->mac, mac_key, key_len, params);
+    OPENSSL_cleanse(mac_key, sizeof(mac_key));
+
+    if(!ok){
+	EVP_MAC_CTX_free(ac->mac);
+	ac->mac = NULL;
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/* Derive ac->auth_key as SHA-256 of another label and the cipher key */
+static int auth_init(struct aes_crypt* ac){
+    static const char label[] = "pa4-encfs header mac";
+    unsigned int key_len;
+    EVP_MD_CTX* md;
+    int ok;
+
+    md = EVP_MD_CTX_new();
+    ok = md && EVP_DigestInit_ex(md, EVP_sha256(), NULL) &&
+	EVP_DigestUpdate(md, label, sizeof(label) - 1) &&
+	EVP_DigestUpdate(md, ac->key, sizeof(ac->key)) &&
+	EVP_DigestFinal_ex(md, ac->auth_key, &key_len);
+    EVP_MD_CTX_free(md);
+    return ok ? SUCCESS : FAILURE;
+}
+
+/* GMAC of aad, the chunk's IV and its ciphertext. The first 12 bytes of
+ * the chunk's random IV are the GMAC nonce, the same nonce budget GCM
+ * chunks already live with. */
+static int chunk_mac(struct aes_crypt* ac, unsigned char* tag,
+		     const unsigned char* aad, int aad_len,
+		     const unsigned char* iv, const unsigned char* data,
+		     int len){
+    EVP_MAC_CTX* ctx = thread_mac(ac);
+    OSSL_PARAM params[2];
+    size_t tag_len;
+
+    /* A NULL key restarts the MAC under the key it already has */
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_IV,
+						  (void*)iv, 12);
+    params[1] = OSSL_PARAM_construct_end();
+    if(!ctx || !EVP_MAC_init(ctx, NULL, 0, params) ||
+       !EVP_MAC_update(ctx, aad, aad_len) ||
+       !EVP_MAC_update(ctx, iv, AES_CRYPT_IV_SIZE) ||
+       !EVP_MAC_update(ctx, data, len) ||
+       !EVP_MAC_final(ctx, tag, &tag_len, AES_CRYPT_TAG_SIZE)){
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/* Chunk cipher modes, indexed by AES_CRYPT_* */
+static const struct {
+    const char* name;
+    const char* alias;
+    const EVP_CIPHER* (*cipher)(void);
+    int tag_len;
+    int seekable;
+} modes[AES_CRYPT_NMODES] = {
+    [AES_CRYPT_CTR] = { "aes-256-ctr", "ctr", EVP_aes_256_ctr, 0, 1 },
+    [AES_CRYPT_GCM] = { "aes-256-gcm", "gcm", EVP_aes_256_gcm,
+			AES_CRYPT_TAG_SIZE, 0 },
+    [AES_CRYPT_XTS] = { "aes-256-xts", "xts", EVP_aes_256_xts, 0, 0 },
+    [AES_CRYPT_CHACHA20_POLY1305] = { "chacha20-poly1305", "chacha20",
+				      EVP_chacha20_poly1305,
+				      AES_CRYPT_TAG_SIZE, 0 },
+};
+
+extern int aes_crypt_mode(const char* name){
+    int i;
+
+    for(i = 0; i < AES_CRYPT_NMODES; i++){
+	if(!strcmp(name, modes[i].name) || !strcmp(name, modes[i].alias)){
+	    return i;
+	}
+    }
+    return -1;
+}
+
+extern int aes_crypt_hw_aes(void){
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("aes") ? 1 : 0;
+#else
+    return -1;
+#endif
+}
+
+extern int aes_crypt_init(struct aes_crypt* ac, char* key_str, int mode){
+    unsigned char iv[32];
+    int nrounds = 5;
+
+    memset(ac, 0, sizeof(*ac));
+    if(!key_str){
+	/* Error */
+	fprintf(stderr, "Key_str must not be NULL\n");
+	return FAILURE;
+    }
+    if(mode < 0 || mode >= AES_CRYPT_NMODES){
+	fprintf(stderr, "Unknown cipher mode %d\n", mode);
+	return FAILURE;
+    }
+    /* Build Key from String (same derivation as do_crypt, just longer) */
+    if(EVP_BytesToKey(EVP_aes_256_xts(), EVP_sha1(), NULL,
+		      (unsigned char*)key_str, strlen(key_str), nrounds,
+		      ac->key, iv) != 64){
+	/* Error */
+	fprintf(stderr, "Key derivation failed\n");
+	return FAILURE;
+    }
+    ac->key_str = key_str;
+    ac->mode = mode;
+    ac->name = modes[mode].name;
+    ac->tag_len = modes[mode].tag_len;
+    ac->seekable = modes[mode].seekable;
+
+    /* Load the key schedule once; chunks only ever change the IV */
+    ac->ctx = EVP_CIPHER_CTX_new();
+    if(!ac->ctx ||
+       !EVP_CipherInit_ex(ac->ctx, modes[mode].cipher(), NULL, ac->key,
+			  NULL, 1)){
+	goto fail;
+    }
+    /* XTS decrypts under a different key schedule than it encrypts, and
+     * re-keying on every chunk whose direction differs from the last would
+     * redo it each time: keep a second engine keyed for decryption */
+    if(mode == AES_CRYPT_XTS){
+	ac->dctx = EVP_CIPHER_CTX_new();
+	if(!ac->dctx ||
+	   !EVP_CipherInit_ex(ac->dctx, modes[mode].cipher(), NULL, ac->key,
+			      NULL, 0)){
+	    goto fail;
+	}
+    }
+
+    /* Modes without a tag of their own authenticate chunks with GMAC */
+    if(!ac->tag_len && !mac_init(ac)){
+	goto fail;
+    }
+    if(!auth_init(ac)){
+	goto fail;
+    }
+
+    /* The thread key comes last, so a failed setup never leaves one
+     * behind for a later aes_crypt_init() to be handed again */
+    if(pthread_key_create(&ac->tls, free_thread_copy)){
+	goto fail;
+    }
+    pthread_mutex_init(&ac->copies_lock, NULL);
+    return SUCCESS;
+
+fail:
+    EVP_CIPHER_CTX_free(ac->ctx);
+    ac->ctx = NULL;
+    EVP_CIPHER_CTX_free(ac->dctx);
+    ac->dctx = NULL;
+    EVP_MAC_CTX_free(ac->mac);
+    ac->mac = NULL;
+    OPENSSL_cleanse(ac->key, sizeof(ac->key));
+    OPENSSL_cleanse(ac->auth_key, sizeof(ac->auth_key));
+    return FAILURE;
+}
+
+extern void aes_crypt_cleanup(struct aes_crypt* ac){
+    struct aes_crypt_copy* copy;
+
+    if(!ac->ctx){
+	/* Never set up, or already cleaned up */
+	return;
+    }
+    /* No destructor runs once the key is gone, so every copy left,
+     * this thread's included, is on the list */
+    pthread_key_delete(ac->tls);
+    pthread_mutex_lock(&ac->copies_lock);
+    while((copy = ac->copies)){
+	ac->copies = copy->next;
+	free_copy(copy);
+    }
+    pthread_mutex_unlock(&ac->copies_lock);
+    pthread_mutex_destroy(&ac->copies_lock);
+
+    EVP_CIPHER_CTX_free(ac->ctx);
+    EVP_CIPHER_CTX_free(ac->dctx);
+    OPENSSL_cleanse(ac->key, sizeof(ac->key));
+    OPENSSL_cleanse(ac->auth_key, sizeof(ac->auth_key));
+    ac->ctx = NULL;
+    ac->dctx = NULL;
+
+    EVP_MAC_CTX_free(ac->mac);
+    ac->mac = NULL;
+}
+
+/* XTS cannot take less than one block: XOR a short chunk with the XTS
+ * encryption of a zero block under its tweak, which is its own inverse.
+ * ctx is the engine keyed for encryption, whichever way the chunk goes. */
+static int xts_short(EVP_CIPHER_CTX* ctx, unsigned char* out,
+		     const unsigned char* in, int len,
+		     const unsigned char* iv){
+    unsigned char pad[16];
+    int outlen;
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, 1) ||
+       !EVP_CipherUpdate(ctx, pad, &outlen, pad, sizeof(pad))){
+	return FAILURE;
+    }
+    for(i = 0; i < len; i++){
+	out[i] = in[i] ^ pad[i];
+    }
+    OPENSSL_cleanse(pad, sizeof(pad));
+    return SUCCESS;
+}
+
+extern int do_crypt_chunk(struct aes_crypt* ac, unsigned char* out,
+			  const unsigned char* in, int len,
+			  unsigned char* iv, int action){
+    return do_crypt_chunk_aad(ac, out, in, len, iv, NULL, 0, action);
+}
+
+extern int do_crypt_chunk_aad(struct aes_crypt* ac, unsigned char* out,
+			      const unsigned char* in, int len,
+			      unsigned char* iv, const unsigned char* aad,
+			      int aad_len, int action){
+    EVP_CIPHER_CTX* ctx;
+    unsigned char* tag = iv + AES_CRYPT_IV_SIZE;
+    unsigned char want[AES_CRYPT_TAG_SIZE];
+    unsigned char fin[16];
+    int mac = aad && !ac->tag_len;
+    int outlen;
+
+    /* A mode that failed aes_crypt_init() has no engine to copy */
+    if(!ac->ctx){
+	return FAILURE;
+    }
+    ctx = thread_ctx(ac, action);
+    if(!ctx){
+	return FAILURE;
+    }
+    /* Encrypt-then-MAC: nothing is decrypted before its tag checks out */
+    if(mac && !action &&
+       (!chunk_mac(ac, want, aad, aad_len, iv, in, len) ||
+	CRYPTO_memcmp(want, tag, sizeof(want)))){
+	return FAILURE;
+    }
+    if(ac->mode == AES_CRYPT_XTS && len < 16){
+	if(!xts_short(thread_ctx(ac, AES_ENCRYPT), out, in, len, iv)){
+	    return FAILURE;
+	}
+	return mac && action ?
+	    chunk_mac(ac, tag, aad, aad_len, iv, out, len) : SUCCESS;
+    }
+
+    /* No mode here pads: one update covers the whole chunk. XTS treats
+     * each update as a data unit, so the chunk must go in one call. */
+    if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, action) ||
+       (ac->tag_len && !action &&
+	!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, ac->tag_len, tag)) ||
+       (ac->tag_len && aad &&
+	!EVP_CipherUpdate(ctx, NULL, &outlen, aad, aad_len)) ||
+       !EVP_CipherUpdate(ctx, out, &outlen, in, len) ||
+       outlen != len){
+	return FAILURE;
+    }
+    if(ac->tag_len){
+	/* Final checks the tag on decrypt and computes it on encrypt */
+	if(!EVP_CipherFinal_ex(ctx, fin, &outlen) ||
+	   (action &&
+	    !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, ac->tag_len, tag))){
+	    return FAILURE;
+	}
+    }
+    if(mac && action){
+	return chunk_mac(ac, tag, aad, aad_len, iv, out, len);
+    }
+    return SUCCESS;
+}
+
+extern int aes_crypt_auth(struct aes_crypt* ac, unsigned char* tag,
+			  const unsigned char* data, size_t len){
+    unsigned char md[32];
+    unsigned int md_len;
+
+    if(!ac->ctx ||
+       !HMAC(EVP_sha256(), ac->auth_key, sizeof(ac->auth_key), data, len,
+	     md, &md_len)){
+	return FAILURE;
+    }
+    memcpy(tag, md, AES_CRYPT_TAG_SIZE);
+    OPENSSL_cleanse(md, sizeof(md));
+    return SUCCESS;
+}
+
+extern int do_crypt_buf(struct aes_crypt* ac, unsigned char* out,
+			const unsigned char* in, size_t len,
+			const unsigned char* iv, off_t offset, int action){
+    EVP_CIPHER_CTX* ctx;
+    unsigned char ctr[16];
+    unsigned char skipbuf[16];
+    uint64_t carry = offset / 16;
+    int skip = offset % 16;
+    int outlen;
+    int i;
+
+    if(!ac->seekable){
+	return FAILURE;
+    }
+    ctx = thread_ctx(ac, action);
+
+    /* Advance the 128 bit big-endian counter to the block holding offset */
+    memcpy(ctr, iv, sizeof(ctr));
+    for(i = 15; i >= 0 && carry; i--){
+	carry += ctr[i];
+	ctr[i] = carry & 0xff;
+	carry >>= 8;
+    }
+
+    if(!ctx || !EVP_CipherInit_ex(ctx, NULL, NULL, NULL, ctr, action)){
+	return FAILURE;
+    }
+    /* Burn the keystream bytes that precede offset within its block */
+    memset(skipbuf, 0, sizeof(skipbuf));
+    if(skip && !EVP_CipherUpdate(ctx, skipbuf, &outlen, skipbuf, skip)){
+	return FAILURE;
+    }
+    /* EVP_CipherUpdate takes an int length */
+    while(len > 0){
+	int n = len > INT_MAX / 2 ? INT_MAX / 2 : (int)len;
+
+	if(!EVP_CipherUpdate(ctx, out, &outlen, in, n) || outlen != n){
+	    return FAILURE;
+	}
+	out += n;
+	in += n;
+	len -= n;
+    }
+    return SUCCESS;
+}
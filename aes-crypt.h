@@ -21,11 +21,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <pthread.h>
 
 #include <openssl/evp.h>
 #include <openssl/aes.h>
 
 #define BLOCKSIZE 1024
+#define FD_BLOCKSIZE (1024 * 1024)
+#define STREAM_BLOCKSIZE (4 * 1024 * 1024)
 #define FAILURE 0
 #define SUCCESS 1
 
@@ -39,4 +43,186 @@
  */
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str);
 
+/* int do_crypt_fd(int in, int out, int action, char* key_str)
+ * Purpose: Same as do_crypt, but on raw file descriptors
+ * Args: int in        : Input file descriptor
+ *       int out       : Output file descriptor
+ *       int action    : Cipher action (1=encrypt, 0=decrypt, -1=pass-through (copy))
+ *	 char* key_str : C-string containing passpharse from which key is derived
+ * Return: FAILURE on error, SUCCESS on success
+ * Note: Moves data with read()/write() in FD_BLOCKSIZE pieces instead of
+ *       going through stdio, so it also works on pipes and sockets.
+ */
+extern int do_crypt_fd(int in, int out, int action, char* key_str);
+
+/* int do_crypt_stream(int in, int out, int action, char* key_str,
+ *                     off_t* in_bytes, off_t* out_bytes)
+ * Purpose: Same as do_crypt_fd, overlapping reads, cipher work and writes
+ * Args: int in          : Input file descriptor
+ *       int out         : Output file descriptor
+ *       int action      : Cipher action (1=encrypt, 0=decrypt, -1=pass-through (copy))
+ *	 char* key_str   : C-string containing passpharse from which key is derived
+ *       off_t* in_bytes : Set to the number of bytes read
+ *       off_t* out_bytes: Set to the number of bytes written
+ * Return: FAILURE on error, SUCCESS on success
+ * Note: Meant for pipes such as tar | aes-crypt-util | ssh. A reader and a
+ *       writer thread move STREAM_BLOCKSIZE blocks while the calling thread
+ *       ciphers the one between them. Pass-through to or from a pipe uses
+ *       splice() instead, so the data is never copied to user space.
+ */
+extern int do_crypt_stream(int in, int out, int action, char* key_str,
+			   off_t* in_bytes, off_t* out_bytes);
+
+/* Chunk cipher modes. The value is what pa4-encfs stores in a file's
+ * header, so existing values must never change. */
+#define AES_CRYPT_CTR               0
+#define AES_CRYPT_GCM               1
+#define AES_CRYPT_XTS               2
+#define AES_CRYPT_CHACHA20_POLY1305 3
+#define AES_CRYPT_NMODES            4
+
+/* Bytes of the IV block passed to do_crypt_chunk: a 16 byte IV (modes with
+ * a 12 byte nonce use the first 12) followed by a 16 byte tag */
+#define AES_CRYPT_IV_SIZE  16
+#define AES_CRYPT_TAG_SIZE 16
+
+/* Cipher state derived once from a passphrase and reused for every chunk.
+ * The expensive work (EVP_BytesToKey and the key schedule) happens in
+ * aes_crypt_init(); each do_crypt_chunk() call only resets the IV.
+ *
+ * An EVP_CIPHER_CTX cannot be shared between threads, so every thread that
+ * uses the state gets its own copy of ctx on first use. That copy is freed
+ * when the thread exits, or by aes_crypt_cleanup() if the thread is still
+ * alive then; copies is the list of them. One struct aes_crypt may
+ * therefore be used concurrently from any number of threads.
+ *
+ * All modes share one key derivation: AES-256-XTS takes all 64 bytes of
+ * key, every other mode the first 32, which are the same bytes do_crypt
+ * derives. XTS, whose decryption needs a key schedule of its own, also
+ * gets dctx, keyed for decryption and copied per thread like ctx. Modes
+ * without a tag of their own (CTR, XTS) also get mac, an AES-256 GMAC
+ * keyed with a hash of key, for do_crypt_chunk_aad; it is copied per
+ * thread the same way as ctx. Every mode gets auth_key, another hash of
+ * key, for aes_crypt_auth.
+ */
+struct aes_crypt {
+    char* key_str;
+    int mode;
+    const char* name;
+    int tag_len;
+    int seekable;
+    unsigned char key[64];
+    unsigned char auth_key[32];
+    EVP_CIPHER_CTX* ctx;
+    EVP_CIPHER_CTX* dctx;
+    EVP_MAC_CTX* mac;
+    pthread_key_t tls;
+    pthread_mutex_t copies_lock;
+    struct aes_crypt_copy* copies;
+};
+
+/* int aes_crypt_init(struct aes_crypt* ac, char* key_str, int mode)
+ * Purpose: Derive the chunk cipher key from a passphrase and set up the engine
+ * Args: struct aes_crypt* ac : Cipher state to initialize
+ *	 char* key_str        : C-string containing passpharse from which key is derived
+ *	 int mode             : One of the AES_CRYPT_* chunk cipher modes
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int aes_crypt_init(struct aes_crypt* ac, char* key_str, int mode);
+
+/* void aes_crypt_cleanup(struct aes_crypt* ac)
+ * Purpose: Release the engine and wipe key material set up by aes_crypt_init,
+ *          including every thread's copy. No other thread may be using ac,
+ *          or exiting after having used it, while this runs.
+ */
+extern void aes_crypt_cleanup(struct aes_crypt* ac);
+
+/* int aes_crypt_mode(const char* name)
+ * Purpose: Look up a chunk cipher mode by name ("aes-256-gcm" or just "gcm")
+ * Return: The AES_CRYPT_* mode, or -1 if name is unknown
+ */
+extern int aes_crypt_mode(const char* name);
+
+/* int aes_crypt_hw_aes(void)
+ * Purpose: Report whether the CPU has AES instructions OpenSSL can use
+ * Return: 1 if it does, 0 if it does not, -1 if this build cannot tell
+ */
+extern int aes_crypt_hw_aes(void);
+
+/* int do_crypt_chunk(struct aes_crypt* ac, unsigned char* out,
+ *                    const unsigned char* in, int len,
+ *                    unsigned char* iv, int action)
+ * Purpose: Perform the chunk cipher on a single in-memory chunk
+ * Args: struct aes_crypt* ac    : Cipher state from aes_crypt_init
+ *       unsigned char* out      : Output buffer (len bytes, may equal in)
+ *       const unsigned char* in : Input buffer (len bytes)
+ *       int len                 : Number of bytes to transform
+ *       unsigned char* iv       : AES_CRYPT_IV_SIZE byte IV followed by
+ *                                 AES_CRYPT_TAG_SIZE bytes of tag space
+ *       int action              : Cipher action (1=encrypt, 0=decrypt)
+ * Return: FAILURE on error (including a tag mismatch), SUCCESS on success
+ * Note: No mode adds padding, so the output is exactly len bytes and any
+ *       chunk can be transformed independently of its neighbours. GCM and
+ *       ChaCha20-Poly1305 write the tag after the IV when encrypting and
+ *       check it when decrypting; the other modes leave it alone. XTS needs
+ *       at least one AES block, so shorter chunks are XORed with the XTS
+ *       encryption of a zero block under the same tweak instead.
+ */
+extern int do_crypt_chunk(struct aes_crypt* ac, unsigned char* out,
+			  const unsigned char* in, int len,
+			  unsigned char* iv, int action);
+
+/* int do_crypt_chunk_aad(struct aes_crypt* ac, unsigned char* out,
+ *                        const unsigned char* in, int len,
+ *                        unsigned char* iv, const unsigned char* aad,
+ *                        int aad_len, int action)
+ * Purpose: do_crypt_chunk, also authenticating aad_len bytes of aad
+ * Return: FAILURE on error (including a tag mismatch), SUCCESS on success
+ * Note: GCM and ChaCha20-Poly1305 pass aad to the AEAD. CTR and XTS have no
+ *       tag of their own, so the tag space gets a GMAC over aad, the IV
+ *       and the ciphertext instead, checked before decrypting. Either way the
+ *       chunk only decrypts with the same aad it was encrypted with. A
+ *       NULL aad is the same as calling do_crypt_chunk.
+ */
+extern int do_crypt_chunk_aad(struct aes_crypt* ac, unsigned char* out,
+			      const unsigned char* in, int len,
+			      unsigned char* iv, const unsigned char* aad,
+			      int aad_len, int action);
+
+/* int aes_crypt_auth(struct aes_crypt* ac, unsigned char* tag,
+ *                    const unsigned char* data, size_t len)
+ * Purpose: Authenticate data that is stored in the clear
+ * Args: struct aes_crypt* ac       : Cipher state from aes_crypt_init
+ *       unsigned char* tag         : Receives AES_CRYPT_TAG_SIZE bytes of tag
+ *       const unsigned char* data  : Bytes to authenticate
+ *       size_t len                 : Number of bytes
+ * Return: FAILURE on error, SUCCESS on success
+ * Note: HMAC-SHA-256 under ac->auth_key, truncated to AES_CRYPT_TAG_SIZE.
+ *       The tag depends on the key phrase only, not the mode, and needs no
+ *       IV, so equal data always gets an equal tag.
+ */
+extern int aes_crypt_auth(struct aes_crypt* ac, unsigned char* tag,
+			  const unsigned char* data, size_t len);
+
+/* int do_crypt_buf(struct aes_crypt* ac, unsigned char* out,
+ *                  const unsigned char* in, size_t len,
+ *                  const unsigned char* iv, off_t offset, int action)
+ * Purpose: Perform the chunk cipher on any span of a chunk
+ * Args: struct aes_crypt* ac    : Cipher state from aes_crypt_init
+ *       unsigned char* out      : Output buffer (len bytes, may equal in)
+ *       const unsigned char* in : Input buffer (len bytes)
+ *       size_t len              : Number of bytes to transform
+ *       const unsigned char* iv : 16 byte counter block the chunk starts at
+ *       off_t offset            : Offset of in within the chunk
+ *       int action              : Cipher action (1=encrypt, 0=decrypt)
+ * Return: FAILURE on error, SUCCESS on success
+ * Note: The output equals bytes [offset, offset + len) of what do_crypt_chunk
+ *       produces for the whole chunk, so callers can transform just the part
+ *       of a chunk they need, in place in the destination buffer. Only
+ *       modes with ac->seekable set (CTR) support this.
+ */
+extern int do_crypt_buf(struct aes_crypt* ac, unsigned char* out,
+			const unsigned char* in, size_t len,
+			const unsigned char* iv, off_t offset, int action);
+
 #endif
@@ -0,0 +1,897 @@
+/* encfs-bench.c
+ * Benchmarks for the aes-crypt library and a mounted pa4-encfs
+ *
+ * encfs-bench -c
+ *   Times do_crypt_chunk_aad() for every chunk cipher mode over a range of
+ *   buffer sizes, plus the legacy whole-file CBC do_crypt(), and prints
+ *   MB/s and cycles per byte.
+ *
+ * encfs-bench -f <dir> [-b <baseline dir>]
+ *   Runs file system workloads in <dir> (normally a pa4-encfs mount) and,
+ *   if given, the same workloads in <baseline dir> (normally a directory
+ *   seen through fusexmp) so FUSE overhead and encryption cost can be told
+ *   apart. Each workload reports ops/s, MB/s and p50/p99 latency.
+ *
+ * encfs-bench -r <trace> -f <dir> [-b <baseline dir>]
+ *   Replays a pa4-encfs -o trace log (see encfs-trace.h) in <dir> and the
+ *   baseline, and reports the same figures per operation type. Traced
+ *   paths are only hashes, so every file becomes <dir>/bench.replay/<hash>;
+ *   file data the trace reads but never wrote is filled in untimed first.
+ *   flush has no system call of its own and is skipped.
+ *
+ * See "make bench" for a run against freshly mounted file systems.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "aes-crypt.h"
+#include "encfs-stats.h"
+#include "encfs-trace.h"
+
+#define SEQ_BLOCK   (128 * 1024)
+#define RAND_BLOCK  4096
+#define SMALL_FILE  4096
+#define DIR_LISTS   50
+#define REPLAY_BUCKETS 4096
+
+/* Crypto microbenchmarks run each size for about this long */
+#define CRYPTO_SECONDS 0.25
+
+struct result {
+    const char* name;
+    const char* target;
+    size_t ops;
+    double seconds;
+    double bytes;
+    double* lat;
+};
+
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t ticks(void){
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void die(const char* what, const char* path){
+    fprintf(stderr, "%s %s: %s\n", what, path ? path : "", strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static int cmp_double(const void* a, const void* b){
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Latency at quantile q (0..1) of the r->ops samples, in microseconds */
+static double percentile(struct result* r, double q){
+    size_t i;
+
+    if(!r->ops){
+	return 0;
+    }
+    i = (size_t)(q * (r->ops - 1) + 0.5);
+    return r->lat[i] * 1e6;
+}
+
+static void report(struct result* r){
+    qsort(r->lat, r->ops, sizeof(*r->lat), cmp_double);
+    printf("%-12s %-9s %8zu %11.0f %9.1f %9.1f %9.1f\n",
+	   r->name, r->target, r->ops, r->ops / r->seconds,
+	   r->bytes / r->seconds / 1e6, percentile(r, 0.50),
+	   percentile(r, 0.99));
+    free(r->lat);
+    r->lat = NULL;
+}
+
+static void result_init(struct result* r, const char* name,
+			const char* target, size_t max_ops){
+    r->name = name;
+    r->target = target;
+    r->ops = 0;
+    r->seconds = 0;
+    r->bytes = 0;
+    r->lat = malloc((max_ops ? max_ops : 1) * sizeof(*r->lat));
+    if(!r->lat){
+	die("malloc", NULL);
+    }
+}
+
+/* Record one operation that started at t0 */
+static void result_add(struct result* r, double t0, size_t bytes){
+    r->lat[r->ops++] = now() - t0;
+    r->bytes += bytes;
+}
+
+/***** Crypto microbenchmarks *****/
+
+/* Chunks are bound to a file id and index the way pa4-encfs binds them in
+ * version 2 files, so CTR and XTS include their GMAC */
+static void bench_chunk(struct aes_crypt* ac, size_t size){
+    unsigned char* pt = malloc(size);
+    unsigned char* ct = malloc(size);
+    unsigned char iv[AES_CRYPT_IV_SIZE + AES_CRYPT_TAG_SIZE];
+    unsigned char aad[24];
+    double t0;
+    double enc;
+    double dec;
+    uint64_t c0;
+    uint64_t enc_ticks;
+    uint64_t dec_ticks;
+    size_t n;
+    size_t i;
+
+    if(!pt || !ct){
+	die("malloc", NULL);
+    }
+    memset(pt, 0xa5, size);
+    memset(iv, 0x3c, sizeof(iv));
+    memset(aad, 0x5a, sizeof(aad));
+
+    /* Size the run from a short calibration pass */
+    n = 1;
+    do{
+	n *= 2;
+	t0 = now();
+	for(i = 0; i < n; i++){
+	    do_crypt_chunk_aad(ac, ct, pt, size, iv, aad, sizeof(aad), 1);
+	}
+    }while(now() - t0 < CRYPTO_SECONDS / 10);
+    n *= 10;
+
+    t0 = now();
+    c0 = ticks();
+    for(i = 0; i < n; i++){
+	do_crypt_chunk_aad(ac, ct, pt, size, iv, aad, sizeof(aad), 1);
+    }
+    enc_ticks = ticks() - c0;
+    enc = now() - t0;
+
+    /* ct and the tag in iv now match, so decryption verifies */
+    t0 = now();
+    c0 = ticks();
+    for(i = 0; i < n; i++){
+	if(!do_crypt_chunk_aad(ac, pt, ct, size, iv, aad, sizeof(aad), 0)){
+	    fprintf(stderr, "%s: decrypt failed\n", ac->name);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    dec_ticks = ticks() - c0;
+    dec = now() - t0;
+
+    printf("%-18s %8zu %10.0f %10.0f", ac->name, size,
+	   n * size / enc / 1e6, n * size / dec / 1e6);
+#ifdef HAVE_TSC
+    printf(" %8.2f %8.2f\n", (double)enc_ticks / (n * size),
+	   (double)dec_ticks / (n * size));
+#else
+    (void)enc_ticks;
+    (void)dec_ticks;
+    printf(" %8s %8s\n", "-", "-");
+#endif
+    free(pt);
+    free(ct);
+}
+
+static void bench_cbc(size_t size){
+    char* pt = malloc(size);
+    char* ct = malloc(size + 32);
+    FILE* in;
+    FILE* out;
+    double t0;
+    double enc;
+    double dec;
+    long clen;
+
+    if(!pt || !ct){
+	die("malloc", NULL);
+    }
+    memset(pt, 0xa5, size);
+
+    in = fmemopen(pt, size, "rb");
+    out = fmemopen(ct, size + 32, "wb");
+    t0 = now();
+    do_crypt(in, out, 1, "bench");
+    enc = now() - t0;
+    clen = ftell(out);
+    fclose(in);
+    fclose(out);
+
+    in = fmemopen(ct, clen, "rb");
+    out = fmemopen(pt, size, "wb");
+    t0 = now();
+    do_crypt(in, out, 0, "bench");
+    dec = now() - t0;
+    fclose(in);
+    fclose(out);
+
+    printf("%-18s %8zu %10.0f %10.0f %8s %8s\n", "aes-256-cbc (file)",
+	   size, size / enc / 1e6, size / dec / 1e6, "-", "-");
+    free(pt);
+    free(ct);
+}
+
+static void bench_crypto(void){
+    static const size_t sizes[] = { 64, 512, 4096, 65536, 1 << 20 };
+    struct aes_crypt ac;
+    int mode;
+    size_t i;
+
+    printf("%-18s %8s %10s %10s %8s %8s\n", "cipher", "bytes",
+	   "enc MB/s", "dec MB/s", "enc c/B", "dec c/B");
+    for(mode = 0; mode < AES_CRYPT_NMODES; mode++){
+	if(!aes_crypt_init(&ac, "bench", mode)){
+	    fprintf(stderr, "cipher mode %d unavailable\n", mode);
+	    continue;
+	}
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+	    bench_chunk(&ac, sizes[i]);
+	}
+	aes_crypt_cleanup(&ac);
+    }
+    bench_cbc(64 << 20);
+#ifdef HAVE_TSC
+    printf("(c/B counts TSC ticks, which run at the nominal clock)\n");
+#endif
+}
+
+/***** File system workloads *****/
+
+static void bench_seq(const char* dir, const char* target, size_t file_mb){
+    char path[4096];
+    char* buf;
+    struct result r;
+    size_t nblocks = (file_mb << 20) / SEQ_BLOCK;
+    size_t i;
+    double start;
+    double t0;
+    int fd;
+
+    buf = malloc(SEQ_BLOCK);
+    if(!buf){
+	die("malloc", NULL);
+    }
+    memset(buf, 0x5a, SEQ_BLOCK);
+    snprintf(path, sizeof(path), "%s/bench.seq", dir);
+
+    result_init(&r, "seq-write", target, nblocks);
+    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if(fd == -1){
+	die("open", path);
+    }
+    start = now();
+    for(i = 0; i < nblocks; i++){
+	t0 = now();
+	if(write(fd, buf, SEQ_BLOCK) != SEQ_BLOCK){
+	    die("write", path);
+	}
+	result_add(&r, t0, SEQ_BLOCK);
+    }
+    if(fsync(fd) == -1 || close(fd) == -1){
+	die("fsync", path);
+    }
+    r.seconds = now() - start;
+    report(&r);
+
+    result_init(&r, "seq-read", target, nblocks);
+    fd = open(path, O_RDONLY);
+    if(fd == -1){
+	die("open", path);
+    }
+    start = now();
+    for(i = 0; i < nblocks; i++){
+	t0 = now();
+	if(read(fd, buf, SEQ_BLOCK) != SEQ_BLOCK){
+	    die("read", path);
+	}
+	result_add(&r, t0, SEQ_BLOCK);
+    }
+    close(fd);
+    r.seconds = now() - start;
+    report(&r);
+
+    free(buf);
+}
+
+/* Random 4 KiB reads and writes over the file bench_seq() left behind */
+static void bench_rand(const char* dir, const char* target, size_t file_mb,
+		       size_t nops){
+    char path[4096];
+    char buf[RAND_BLOCK];
+    struct result r;
+    size_t nblocks = (file_mb << 20) / RAND_BLOCK;
+    unsigned int seed = 1;
+    size_t i;
+    off_t off;
+    double start;
+    double t0;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/bench.seq", dir);
+    fd = open(path, O_RDWR);
+    if(fd == -1){
+	die("open", path);
+    }
+    memset(buf, 0x77, sizeof(buf));
+
+    result_init(&r, "rand-read", target, nops);
+    start = now();
+    for(i = 0; i < nops; i++){
+	off = (off_t)(rand_r(&seed) % nblocks) * RAND_BLOCK;
+	t0 = now();
+	if(pread(fd, buf, RAND_BLOCK, off) != RAND_BLOCK){
+	    die("pread", path);
+	}
+	result_add(&r, t0, RAND_BLOCK);
+    }
+    r.seconds = now() - start;
+    report(&r);
+
+    result_init(&r, "rand-write", target, nops);
+    start = now();
+    for(i = 0; i < nops; i++){
+	off = (off_t)(rand_r(&seed) % nblocks) * RAND_BLOCK;
+	t0 = now();
+	if(pwrite(fd, buf, RAND_BLOCK, off) != RAND_BLOCK){
+	    die("pwrite", path);
+	}
+	result_add(&r, t0, RAND_BLOCK);
+    }
+    if(fsync(fd) == -1){
+	die("fsync", path);
+    }
+    r.seconds = now() - start;
+    report(&r);
+
+    close(fd);
+    unlink(path);
+}
+
+/* Create, list, stat and unlink nfiles small files */
+static void bench_meta(const char* dir, const char* target, size_t nfiles){
+    char sub[4096];
+    char path[4096 + 32];
+    char buf[SMALL_FILE];
+    struct result r;
+    struct stat st;
+    struct dirent* de;
+    DIR* d;
+    size_t i;
+    double start;
+    double t0;
+    int fd;
+
+    snprintf(sub, sizeof(sub), "%s/bench.small", dir);
+    if(mkdir(sub, 0755) == -1 && errno != EEXIST){
+	die("mkdir", sub);
+    }
+    memset(buf, 0x33, sizeof(buf));
+
+    result_init(&r, "create", target, nfiles);
+    start = now();
+    for(i = 0; i < nfiles; i++){
+	snprintf(path, sizeof(path), "%s/f%06zu", sub, i);
+	t0 = now();
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if(fd == -1 || write(fd, buf, sizeof(buf)) != sizeof(buf) ||
+	   close(fd) == -1){
+	    die("create", path);
+	}
+	result_add(&r, t0, sizeof(buf));
+    }
+    r.seconds = now() - start;
+    report(&r);
+
+    result_init(&r, "readdir", target, DIR_LISTS);
+    start = now();
+    for(i = 0; i < DIR_LISTS; i++){
+	t0 = now();
+	d = opendir(sub);
+	if(!d){
+	    die("opendir", sub);
+	}
+	while((de = readdir(d))){
+	    ;
+	}
+	closedir(d);
+	result_add(&r, t0, 0);
+    }
+    r.seconds = now() - start;
+    report(&r);
+
+    result_init(&r, "stat", target, nfiles);
+    start = now();
+    for(i = 0; i < nfiles; i++){
+	snprintf(path, sizeof(path), "%s/f%06zu", sub, i);
+	t0 = now();
+	if(stat(path, &st) == -1){
+	    die("stat", path);
+	}
+	result_add(&r, t0, 0);
+    }
+    r.seconds = now() - start;
+    report(&r);
+
+    result_init(&r, "unlink", target, nfiles);
+    start = now();
+    for(i = 0; i < nfiles; i++){
+	snprintf(path, sizeof(path), "%s/f%06zu", sub, i);
+	t0 = now();
+	if(unlink(path) == -1){
+	    die("unlink", path);
+	}
+	result_add(&r, t0, 0);
+    }
+    r.seconds = now() - start;
+    report(&r);
+
+    rmdir(sub);
+}
+
+static void bench_fs(const char* dir, const char* target, size_t file_mb,
+		     size_t nops, size_t nfiles){
+    bench_seq(dir, target, file_mb);
+    bench_rand(dir, target, file_mb, nops);
+    bench_meta(dir, target, nfiles);
+}
+
+/***** Trace replay *****/
+
+struct replay_rec {
+    int op;
+    uint64_t hash;
+    uint64_t hash2;
+    long long offset;
+    unsigned long long size;
+    int res;
+};
+
+/* A traced file and the descriptor its open handles share */
+struct replay_file {
+    uint64_t hash;
+    int fd;
+    int refs;
+    off_t size;
+    struct replay_file* next;
+};
+
+struct replay {
+    char dir[4096];
+    struct replay_file* files[REPLAY_BUCKETS];
+    char* buf;
+    size_t buf_size;
+};
+
+/* Parse one trace line; returns 0 for comments and unknown operations */
+static int replay_parse(const char* line, struct replay_rec* r){
+    char op[32];
+    unsigned long long start;
+    unsigned long long ns;
+    unsigned long long hash;
+    unsigned long long hash2;
+
+    if(sscanf(line, "%llu %31s %llx %llx %lld %llu %llu %d", &start, op,
+	      &hash, &hash2, &r->offset, &r->size, &ns, &r->res) != 8){
+	return 0;
+    }
+    r->op = encfs_stats_lookup(op);
+    r->hash = hash;
+    r->hash2 = hash2;
+    return r->op >= 0;
+}
+
+static void replay_path(struct replay* rp, uint64_t hash, char* path,
+			size_t size){
+    snprintf(path, size, "%s/%016llx", rp->dir, (unsigned long long)hash);
+}
+
+static struct replay_file** replay_slot(struct replay* rp, uint64_t hash){
+    struct replay_file** fp = &rp->files[hash % REPLAY_BUCKETS];
+
+    while(*fp && (*fp)->hash != hash){
+	fp = &(*fp)->next;
+    }
+    return fp;
+}
+
+/* The file for hash, opened (and created) if no traced handle has it */
+static struct replay_file* replay_file(struct replay* rp, uint64_t hash){
+    struct replay_file** fp = replay_slot(rp, hash);
+    struct replay_file* f = *fp;
+    char path[4096 + 32];
+    struct stat st;
+
+    if(!f){
+	f = calloc(1, sizeof(*f));
+	if(!f){
+	    die("malloc", NULL);
+	}
+	f->hash = hash;
+	f->fd = -1;
+	*fp = f;
+    }
+    if(f->fd == -1){
+	replay_path(rp, hash, path, sizeof(path));
+	f->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(f->fd == -1 || fstat(f->fd, &st) == -1){
+	    die("open", path);
+	}
+	f->size = st.st_size;
+    }
+    return f;
+}
+
+static void replay_buf(struct replay* rp, size_t size){
+    if(size <= rp->buf_size){
+	return;
+    }
+    free(rp->buf);
+    rp->buf = malloc(size);
+    if(!rp->buf){
+	die("malloc", NULL);
+    }
+    memset(rp->buf, 0x6b, size);
+    rp->buf_size = size;
+}
+
+/* Extend f (untimed) so a read that returned len bytes at off can too */
+static void replay_fill(struct replay* rp, struct replay_file* f, off_t off,
+			size_t len){
+    size_t n;
+
+    while(f->size < off + (off_t)len){
+	n = off + len - f->size;
+	if(n > SEQ_BLOCK){
+	    n = SEQ_BLOCK;
+	}
+	replay_buf(rp, n);
+	if(pwrite(f->fd, rp->buf, n, f->size) != (ssize_t)n){
+	    die("pwrite", rp->dir);
+	}
+	f->size += n;
+    }
+}
+
+/* Issue the system call that made r, timing it into res */
+static void replay_one(struct replay* rp, struct replay_rec* r,
+		       struct result* res){
+    char path[4096 + 32];
+    char path2[4096 + 32];
+    struct replay_file** fp;
+    struct replay_file* f;
+    struct stat st;
+    struct dirent* de;
+    DIR* d;
+    double t0;
+    size_t bytes = 0;
+    ssize_t n;
+    off_t len;
+    int mode;
+
+    replay_path(rp, r->hash, path, sizeof(path));
+    switch(r->op){
+    case ENCFS_STAT_READ:
+    case ENCFS_STAT_WRITE:
+    case ENCFS_STAT_FSYNC:
+    case ENCFS_STAT_RELEASE:
+    case ENCFS_STAT_FALLOCATE:
+	f = replay_file(rp, r->hash);
+	if(r->op == ENCFS_STAT_READ && r->res > 0){
+	    replay_fill(rp, f, r->offset, r->res);
+	}
+	if(r->op == ENCFS_STAT_READ || r->op == ENCFS_STAT_WRITE){
+	    replay_buf(rp, r->size);
+	}
+	break;
+    default:
+	f = NULL;
+    }
+
+    t0 = now();
+    switch(r->op){
+    case ENCFS_STAT_GETATTR:
+	stat(path, &st);
+	break;
+    case ENCFS_STAT_READDIR:
+	d = opendir(rp->dir);
+	if(!d){
+	    die("opendir", rp->dir);
+	}
+	while((de = readdir(d))){
+	    ;
+	}
+	closedir(d);
+	break;
+    case ENCFS_STAT_OPEN:
+    case ENCFS_STAT_CREATE:
+	f = replay_file(rp, r->hash);
+	f->refs++;
+	if(r->op == ENCFS_STAT_CREATE || (r->size & O_TRUNC)){
+	    if(ftruncate(f->fd, 0) == 0){
+		f->size = 0;
+	    }
+	}
+	break;
+    case ENCFS_STAT_READ:
+	n = pread(f->fd, rp->buf, r->size, r->offset);
+	bytes = n > 0 ? n : 0;
+	break;
+    case ENCFS_STAT_WRITE:
+	n = pwrite(f->fd, rp->buf, r->size, r->offset);
+	if(n > 0){
+	    bytes = n;
+	    if(f->size < r->offset + n){
+		f->size = r->offset + n;
+	    }
+	}
+	break;
+    case ENCFS_STAT_FSYNC:
+	if(r->size){
+	    fdatasync(f->fd);
+	}
+	else{
+	    fsync(f->fd);
+	}
+	break;
+    case ENCFS_STAT_RELEASE:
+	if(f->refs > 0 && --f->refs == 0){
+	    close(f->fd);
+	    f->fd = -1;
+	}
+	break;
+    case ENCFS_STAT_FALLOCATE:
+	mode = r->size >> ENCFS_TRACE_MODE_SHIFT;
+	len = r->size & ((1ULL << ENCFS_TRACE_MODE_SHIFT) - 1);
+	if(fallocate(f->fd, mode, r->offset, len) == 0 &&
+	   !(mode & FALLOC_FL_KEEP_SIZE) && f->size < r->offset + len){
+	    f->size = r->offset + len;
+	}
+	break;
+    case ENCFS_STAT_TRUNCATE:
+	fp = replay_slot(rp, r->hash);
+	if(*fp && (*fp)->fd != -1){
+	    if(ftruncate((*fp)->fd, r->offset) == 0){
+		(*fp)->size = r->offset;
+	    }
+	}
+	else{
+	    n = truncate(path, r->offset);
+	}
+	break;
+    case ENCFS_STAT_UNLINK:
+	unlink(path);
+	break;
+    case ENCFS_STAT_RENAME:
+	replay_path(rp, r->hash2, path2, sizeof(path2));
+	if(rename(path, path2) == 0){
+	    /* Whatever was at the target is gone; the source takes over */
+	    fp = replay_slot(rp, r->hash2);
+	    if((f = *fp)){
+		*fp = f->next;
+		if(f->fd != -1){
+		    close(f->fd);
+		}
+		free(f);
+	    }
+	    fp = replay_slot(rp, r->hash);
+	    if((f = *fp)){
+		*fp = f->next;
+		f->hash = r->hash2;
+		f->next = NULL;
+		*replay_slot(rp, r->hash2) = f;
+	    }
+	}
+	break;
+    default:
+	return;
+    }
+    result_add(res, t0, bytes);
+}
+
+static void replay_free(struct replay* rp){
+    struct replay_file* f;
+    int i;
+
+    for(i = 0; i < REPLAY_BUCKETS; i++){
+	while((f = rp->files[i])){
+	    rp->files[i] = f->next;
+	    if(f->fd != -1){
+		close(f->fd);
+	    }
+	    free(f);
+	}
+    }
+    free(rp->buf);
+}
+
+/* Remove what a replay in dir left behind */
+static void replay_clean(const char* dir){
+    char path[4096 + 32];
+    struct dirent* de;
+    DIR* d = opendir(dir);
+
+    if(!d){
+	return;
+    }
+    while((de = readdir(d))){
+	if(de->d_name[0] != '.'){
+	    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+	    unlink(path);
+	}
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+static void bench_replay(const char* trace, const char* dir,
+			 const char* target){
+    static struct replay rp;
+    struct result results[ENCFS_STAT_COUNT];
+    struct result total;
+    struct replay_rec r;
+    size_t counts[ENCFS_STAT_COUNT] = { 0 };
+    size_t nrecs = 0;
+    char line[512];
+    double start;
+    int i;
+    FILE* in;
+
+    in = fopen(trace, "r");
+    if(!in){
+	die("open", trace);
+    }
+    while(fgets(line, sizeof(line), in)){
+	if(replay_parse(line, &r)){
+	    counts[r.op]++;
+	    nrecs++;
+	}
+    }
+
+    memset(&rp, 0, sizeof(rp));
+    snprintf(rp.dir, sizeof(rp.dir), "%s/bench.replay", dir);
+    replay_clean(rp.dir);
+    if(mkdir(rp.dir, 0755) == -1){
+	die("mkdir", rp.dir);
+    }
+    for(i = 0; i < ENCFS_STAT_COUNT; i++){
+	result_init(&results[i], encfs_stats_name(i), target, counts[i]);
+    }
+    result_init(&total, "replay", target, nrecs);
+
+    rewind(in);
+    start = now();
+    while(fgets(line, sizeof(line), in)){
+	if(replay_parse(line, &r)){
+	    replay_one(&rp, &r, &results[r.op]);
+	}
+    }
+    total.seconds = now() - start;
+    fclose(in);
+
+    /* Operations interleave, so each type is rated on its own time */
+    for(i = 0; i < ENCFS_STAT_COUNT; i++){
+	struct result* res = &results[i];
+	size_t j;
+
+	for(j = 0; j < res->ops; j++){
+	    res->seconds += res->lat[j];
+	    total.lat[total.ops++] = res->lat[j];
+	}
+	total.bytes += res->bytes;
+	if(res->ops && res->seconds > 0){
+	    report(res);
+	}
+	else{
+	    free(res->lat);
+	}
+    }
+    report(&total);
+
+    replay_free(&rp);
+    replay_clean(rp.dir);
+}
+
+static void usage(const char* prog){
+    fprintf(stderr, "usage: %s -c\n", prog);
+    fprintf(stderr, "       %s -f <dir> [-b <baseline dir>] [-s <file MiB>]"
+	    " [-n <random ops>] [-k <small files>]\n", prog);
+    fprintf(stderr, "       %s -r <trace> -f <dir> [-b <baseline dir>]\n",
+	    prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    const char* dir = NULL;
+    const char* base = NULL;
+    const char* trace = NULL;
+    size_t file_mb = 256;
+    size_t nops = 20000;
+    size_t nfiles = 2000;
+    int crypto = 0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "cf:b:r:s:n:k:")) != -1){
+	switch(opt){
+	case 'c':
+	    crypto = 1;
+	    break;
+	case 'f':
+	    dir = optarg;
+	    break;
+	case 'b':
+	    base = optarg;
+	    break;
+	case 'r':
+	    trace = optarg;
+	    break;
+	case 's':
+	    file_mb = strtoul(optarg, NULL, 10);
+	    break;
+	case 'n':
+	    nops = strtoul(optarg, NULL, 10);
+	    break;
+	case 'k':
+	    nfiles = strtoul(optarg, NULL, 10);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if((!crypto && !dir) || (base && !dir) || (trace && !dir) ||
+       file_mb == 0){
+	usage(argv[0]);
+    }
+
+    if(crypto){
+	bench_crypto();
+    }
+    if(dir){
+	if(crypto){
+	    printf("\n");
+	}
+	printf("%-12s %-9s %8s %11s %9s %9s %9s\n", "workload", "target",
+	       "ops", "ops/s", "MB/s", "p50 us", "p99 us");
+	if(trace){
+	    bench_replay(trace, dir, "encfs");
+	    if(base){
+		bench_replay(trace, base, "baseline");
+	    }
+	}
+	else{
+	    bench_fs(dir, "encfs", file_mb, nops, nfiles);
+	    if(base){
+		bench_fs(base, "baseline", file_mb, nops, nfiles);
+	    }
+	}
+    }
+
+    return EXIT_SUCCESS;
+}
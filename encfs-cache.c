@@ -0,0 +1,274 @@
+/* encfs-cache.c
+ * Shared cache of decrypted pa4-encfs chunks
+ *
+ * See encfs-cache.h for the interface.
+ *
+ * Every entry sits on three lists: its (dev, ino, idx) hash chain for
+ * lookups, its (dev, ino) hash chain so a whole file can be invalidated
+ * without scanning the cache, and the LRU list (most recent first).
+ *
+ */
+
+#include "encfs-cache.h"
+#include "encfs-chunk.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+struct encfs_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    off_t idx;
+    unsigned char id[ENCFS_ID_SIZE];
+    size_t len;
+    struct encfs_cache_entry* hnext;
+    struct encfs_cache_entry** hpprev;
+    struct encfs_cache_entry* inext;
+    struct encfs_cache_entry** ipprev;
+    struct encfs_cache_entry* lru_prev;
+    struct encfs_cache_entry* lru_next;
+    unsigned char data[ENCFS_CHUNK_SIZE];
+};
+
+struct encfs_cache {
+    pthread_mutex_t lock;
+    size_t max_entries;
+    size_t nentries;
+    size_t nbuckets;
+    struct encfs_cache_entry** chunks;
+    struct encfs_cache_entry** files;
+    /* LRU sentinel: lru.lru_next is the most recently used entry */
+    struct encfs_cache_entry lru;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+static size_t file_hash(struct encfs_cache* cache, dev_t dev, ino_t ino){
+    uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+
+    h ^= h >> 29;
+    return h % cache->nbuckets;
+}
+
+static size_t chunk_hash(struct encfs_cache* cache, dev_t dev, ino_t ino,
+			 off_t idx){
+    uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+
+    h = (h ^ (uint64_t)idx) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h % cache->nbuckets;
+}
+
+static struct encfs_cache_entry* lookup(struct encfs_cache* cache, dev_t dev,
+					ino_t ino, off_t idx){
+    struct encfs_cache_entry* e;
+
+    for(e = cache->chunks[chunk_hash(cache, dev, ino, idx)]; e; e = e->hnext){
+	if(e->idx == idx && e->ino == ino && e->dev == dev){
+	    return e;
+	}
+    }
+    return NULL;
+}
+
+static void lru_unlink(struct encfs_cache_entry* e){
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push(struct encfs_cache* cache, struct encfs_cache_entry* e){
+    e->lru_prev = &cache->lru;
+    e->lru_next = cache->lru.lru_next;
+    cache->lru.lru_next->lru_prev = e;
+    cache->lru.lru_next = e;
+}
+
+/* Unlink e from every list and free it */
+static void drop(struct encfs_cache* cache, struct encfs_cache_entry* e){
+    *e->hpprev = e->hnext;
+    if(e->hnext){
+	e->hnext->hpprev = e->hpprev;
+    }
+    *e->ipprev = e->inext;
+    if(e->inext){
+	e->inext->ipprev = e->ipprev;
+    }
+    lru_unlink(e);
+    cache->nentries--;
+    free(e);
+}
+
+extern struct encfs_cache* encfs_cache_new(size_t budget){
+    struct encfs_cache* cache;
+
+    cache = calloc(1, sizeof(*cache));
+    if(!cache){
+	return NULL;
+    }
+    cache->max_entries = budget / ENCFS_CHUNK_SIZE;
+    cache->nbuckets = cache->max_entries ? cache->max_entries : 1;
+    cache->chunks = calloc(cache->nbuckets, sizeof(*cache->chunks));
+    cache->files = calloc(cache->nbuckets, sizeof(*cache->files));
+    if(!cache->chunks || !cache->files){
+	free(cache->chunks);
+	free(cache->files);
+	free(cache);
+	return NULL;
+    }
+    cache->lru.lru_next = cache->lru.lru_prev = &cache->lru;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+extern void encfs_cache_free(struct encfs_cache* cache){
+    if(!cache){
+	return;
+    }
+    while(cache->lru.lru_next != &cache->lru){
+	drop(cache, cache->lru.lru_next);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->chunks);
+    free(cache->files);
+    free(cache);
+}
+
+extern ssize_t encfs_cache_get(struct encfs_cache* cache, dev_t dev, ino_t ino,
+			       const unsigned char* id, off_t idx, size_t off,
+			       size_t len, void* dst){
+    struct encfs_cache_entry* e;
+    ssize_t res = -1;
+
+    pthread_mutex_lock(&cache->lock);
+    e = lookup(cache, dev, ino, idx);
+    if(e && memcmp(e->id, id, ENCFS_ID_SIZE)){
+	/* Left over from an earlier file on the same inode */
+	drop(cache, e);
+	e = NULL;
+    }
+    if(e){
+	cache->hits++;
+	lru_unlink(e);
+	lru_push(cache, e);
+	res = 0;
+	if(off < e->len){
+	    res = e->len - off < len ? e->len - off : len;
+	    memcpy(dst, e->data + off, res);
+	}
+    }
+    else{
+	cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return res;
+}
+
+extern int encfs_cache_has(struct encfs_cache* cache, dev_t dev, ino_t ino,
+			   const unsigned char* id, off_t idx){
+    struct encfs_cache_entry* e;
+    int res;
+
+    pthread_mutex_lock(&cache->lock);
+    e = lookup(cache, dev, ino, idx);
+    res = e && !memcmp(e->id, id, ENCFS_ID_SIZE);
+    pthread_mutex_unlock(&cache->lock);
+
+    return res;
+}
+
+extern void encfs_cache_put(struct encfs_cache* cache, dev_t dev, ino_t ino,
+			    const unsigned char* id, off_t idx,
+			    const void* plain, size_t len){
+    struct encfs_cache_entry* e;
+    struct encfs_cache_entry** head;
+
+    if(!cache->max_entries){
+	return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    e = lookup(cache, dev, ino, idx);
+    if(e){
+	lru_unlink(e);
+    }
+    else{
+	if(cache->nentries >= cache->max_entries){
+	    /* Recycle the least recently used entry */
+	    e = cache->lru.lru_prev;
+	    drop(cache, e);
+	    cache->evictions++;
+	}
+	e = malloc(sizeof(*e));
+	if(!e){
+	    pthread_mutex_unlock(&cache->lock);
+	    return;
+	}
+	e->dev = dev;
+	e->ino = ino;
+	e->idx = idx;
+
+	head = &cache->chunks[chunk_hash(cache, dev, ino, idx)];
+	e->hnext = *head;
+	e->hpprev = head;
+	if(*head){
+	    (*head)->hpprev = &e->hnext;
+	}
+	*head = e;
+
+	head = &cache->files[file_hash(cache, dev, ino)];
+	e->inext = *head;
+	e->ipprev = head;
+	if(*head){
+	    (*head)->ipprev = &e->inext;
+	}
+	*head = e;
+
+	cache->nentries++;
+    }
+    memcpy(e->id, id, ENCFS_ID_SIZE);
+    e->len = len;
+    memcpy(e->data, plain, len);
+    lru_push(cache, e);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+extern void encfs_cache_invalidate(struct encfs_cache* cache, dev_t dev,
+				   ino_t ino, off_t first, off_t last){
+    struct encfs_cache_entry* e;
+    struct encfs_cache_entry* next;
+    off_t idx;
+
+    pthread_mutex_lock(&cache->lock);
+    if(last >= first && (size_t)(last - first) < cache->nbuckets){
+	/* Small range: probe each chunk directly */
+	for(idx = first; idx <= last; idx++){
+	    e = lookup(cache, dev, ino, idx);
+	    if(e){
+		drop(cache, e);
+	    }
+	}
+    }
+    else{
+	for(e = cache->files[file_hash(cache, dev, ino)]; e; e = next){
+	    next = e->inext;
+	    if(e->ino == ino && e->dev == dev && e->idx >= first &&
+	       (last < 0 || e->idx <= last)){
+		drop(cache, e);
+	    }
+	}
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+extern void encfs_cache_get_stats(struct encfs_cache* cache,
+				  struct encfs_cache_stats* stats){
+    pthread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->entries = cache->nentries;
+    stats->bytes = cache->nentries * ENCFS_CHUNK_SIZE;
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,65 @@
+/* encfs-cache.h
+ * Shared cache of decrypted pa4-encfs chunks
+ *
+ * Holds the plaintext of recently read chunks, keyed by the backing file's
+ * (device, inode) pair and the chunk index, so that repeat reads of the same
+ * region - from any handle or process - are served with a memcpy instead of
+ * a pread and decrypt. Every entry also records the file id from the
+ * header it was decrypted under (ENCFS_ID_SIZE bytes, see encfs-chunk.h);
+ * a lookup under another id misses, so a reused inode number never sees
+ * an older file's chunks. The cache is bounded by a byte budget fixed at
+ * creation time and evicts the least recently used chunk when full.
+ *
+ * The cache never goes to disk on its own: callers insert what they decrypt
+ * and must invalidate chunks whenever they change them on disk. All
+ * functions are safe to call from multiple threads.
+ */
+
+#ifndef ENCFS_CACHE_H
+#define ENCFS_CACHE_H
+
+#include <sys/types.h>
+
+struct encfs_cache;
+
+struct encfs_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t entries;
+    size_t bytes;
+};
+
+/* Create a cache holding at most budget bytes of plaintext, or NULL on error */
+extern struct encfs_cache* encfs_cache_new(size_t budget);
+
+/* Free the cache and everything in it */
+extern void encfs_cache_free(struct encfs_cache* cache);
+
+/* Copy up to len bytes starting at offset off of a cached chunk into dst.
+ * Returns the number of bytes copied (0 if off is past the end of a short
+ * chunk) or -1 if the chunk is not cached under id. */
+extern ssize_t encfs_cache_get(struct encfs_cache* cache, dev_t dev, ino_t ino,
+			       const unsigned char* id, off_t idx, size_t off,
+			       size_t len, void* dst);
+
+/* Whether a chunk is cached, without counting a hit or miss or touching
+ * its LRU position (for read-ahead deciding what is left to fetch) */
+extern int encfs_cache_has(struct encfs_cache* cache, dev_t dev, ino_t ino,
+			   const unsigned char* id, off_t idx);
+
+/* Insert (or replace) the len byte plaintext of a chunk of file id */
+extern void encfs_cache_put(struct encfs_cache* cache, dev_t dev, ino_t ino,
+			    const unsigned char* id, off_t idx,
+			    const void* plain, size_t len);
+
+/* Drop cached chunks first..last (inclusive) of a file; pass last = -1 to
+ * drop every chunk from first onwards */
+extern void encfs_cache_invalidate(struct encfs_cache* cache, dev_t dev,
+				   ino_t ino, off_t first, off_t last);
+
+/* Snapshot the cache counters */
+extern void encfs_cache_get_stats(struct encfs_cache* cache,
+				  struct encfs_cache_stats* stats);
+
+#endif
@@ -0,0 +1,1222 @@
+/* encfs-chunk.c
+ * Chunked, randomly addressable on-disk format for pa4-encfs encrypted files
+ *
+ * See encfs-chunk.h for the layout.
+ *
+ */
+
+/* SEEK_DATA, SEEK_HOLE and fallocate() */
+#define _GNU_SOURCE
+
+#include "encfs-chunk.h"
+#include "encfs-pool.h"
+#include "encfs-stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+/* Cipher work for one chunk of a batch */
+struct crypt_item {
+    unsigned char* out;
+    const unsigned char* in;
+    size_t len;
+    size_t skip;
+    off_t idx;
+    const unsigned char* trailer;
+};
+
+struct crypt_batch {
+    struct encfs_key* key;
+    struct crypt_item items[ENCFS_BATCH_CHUNKS];
+    int err;
+};
+
+/* Additional data binding a chunk to its file and position: the file id
+ * and the 64-bit little-endian chunk index, followed from version 3 on by
+ * the 32-bit version, so a file cannot pass for an older version */
+#define CHUNK_AAD_SIZE (ENCFS_ID_SIZE + 12)
+
+/* Version 3 header fields past the id: the 64-bit plaintext size and a tag
+ * over everything before the tag */
+#define HDR_SIZE_OFF (20 + ENCFS_ID_SIZE)
+#define HDR_TAG_OFF  (HDR_SIZE_OFF + 8)
+
+/* IV byte filling the IV of a version 3 hole trailer */
+#define HOLE_IV 0xff
+
+static struct encfs_pool* crypt_pool;
+
+static void put_le32(unsigned char* p, uint32_t v){
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get_le32(const unsigned char* p){
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le64(unsigned char* p, uint64_t v){
+    put_le32(p, v & 0xffffffff);
+    put_le32(p + 4, v >> 32);
+}
+
+static uint64_t get_le64(const unsigned char* p){
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static int is_zero(const unsigned char* p, size_t len){
+    size_t i;
+
+    for(i = 0; i < len; i++){
+	if(p[i]){
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/* pread()/pwrite() that retry on short transfers and EINTR */
+static ssize_t pread_full(int fd, void* buf, size_t len, off_t off){
+    uint64_t start = encfs_stats_now();
+    size_t done = 0;
+    ssize_t res;
+
+    while(done < len){
+	res = pread(fd, (char*)buf + done, len - done, off + done);
+	if(res == -1){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    res = -errno;
+	    encfs_stats_add(ENCFS_STAT_IO, start, res, done);
+	    return res;
+	}
+	if(res == 0){
+	    /* EOF */
+	    break;
+	}
+	done += res;
+    }
+    encfs_stats_add(ENCFS_STAT_IO, start, 0, done);
+    return done;
+}
+
+static ssize_t pwrite_full(int fd, const void* buf, size_t len, off_t off){
+    uint64_t start = encfs_stats_now();
+    size_t done = 0;
+    ssize_t res;
+
+    while(done < len){
+	res = pwrite(fd, (const char*)buf + done, len - done, off + done);
+	if(res == -1){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    res = -errno;
+	    encfs_stats_add(ENCFS_STAT_IO, start, res, done);
+	    return res;
+	}
+	done += res;
+    }
+    encfs_stats_add(ENCFS_STAT_IO, start, 0, done);
+    return done;
+}
+
+/* Fill aad for chunk idx, or return NULL for a version 1 file, whose
+ * chunks are not bound to anything */
+static const unsigned char* chunk_aad(const struct encfs_key* key, off_t idx,
+				      unsigned char* aad){
+    if(key->version < 2){
+	return NULL;
+    }
+    memcpy(aad, key->id, ENCFS_ID_SIZE);
+    put_le64(aad + ENCFS_ID_SIZE, idx);
+    put_le32(aad + ENCFS_ID_SIZE + 8, key->version);
+    return aad;
+}
+
+/* Bytes of chunk_aad() the file's version uses */
+static int aad_len(const struct encfs_key* key){
+    return key->version < 3 ? ENCFS_ID_SIZE + 8 : CHUNK_AAD_SIZE;
+}
+
+/* Whether a version 3 trailer is a hole's: its IV is all HOLE_IV */
+static int is_hole_iv(const unsigned char* trailer){
+    size_t i;
+
+    for(i = 0; i < ENCFS_IV_SIZE; i++){
+	if(trailer[i] != HOLE_IV){
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/* The tag of a hole at chunk idx: aes_crypt_auth() over "HOLE" and the
+ * chunk's aad, so a hole only verifies in its own place */
+static int hole_tag(unsigned char* tag, struct encfs_key* key, off_t idx){
+    unsigned char msg[4 + CHUNK_AAD_SIZE];
+
+    memcpy(msg, "HOLE", 4);
+    chunk_aad(key, idx, msg + 4);
+    return aes_crypt_auth(key->ac, tag, msg, sizeof(msg)) ? 0 : -EIO;
+}
+
+/* Fill in the trailer of a hole at chunk idx of a version 3 file */
+static int make_hole(unsigned char* trailer, struct encfs_key* key,
+		     off_t idx){
+    memset(trailer, HOLE_IV, ENCFS_IV_SIZE);
+    return hole_tag(trailer + ENCFS_IV_SIZE, key, idx);
+}
+
+/* Whether the chunk idx with this trailer reads as zeros (1), has to be
+ * decrypted (0) or is corrupt (-EIO). Before version 3 an all zero trailer
+ * is a hole; from then on only an authenticated hole trailer is, and an all
+ * zero one means the chunk was cut off or punched out behind our back. */
+static int check_hole(const unsigned char* trailer, struct encfs_key* key,
+		      off_t idx){
+    unsigned char tag[AES_CRYPT_TAG_SIZE];
+
+    if(key->version < 3){
+	return is_zero(trailer, ENCFS_TRAILER_SIZE);
+    }
+    if(is_hole_iv(trailer)){
+	if(hole_tag(tag, key, idx) < 0 ||
+	   CRYPTO_memcmp(tag, trailer + ENCFS_IV_SIZE, sizeof(tag))){
+	    return -EIO;
+	}
+	return 1;
+    }
+    return is_zero(trailer, ENCFS_TRAILER_SIZE) ? -EIO : 0;
+}
+
+/* Fill in the header of a file of plain_size bytes under key. The tag of
+ * a version 3 header covers every field before it. */
+static int build_header(unsigned char* hdr, struct encfs_key* key,
+			off_t plain_size){
+    /* magic[8] version[4] chunk_size[4] mode[4] id[16] size[8] tag[16]
+     * reserved[4] */
+    memset(hdr, 0, ENCFS_HEADER_SIZE);
+    memcpy(hdr, ENCFS_MAGIC, sizeof(ENCFS_MAGIC));
+    put_le32(hdr + 8, key->version);
+    put_le32(hdr + 12, ENCFS_CHUNK_SIZE);
+    put_le32(hdr + 16, key->ac->mode);
+    memcpy(hdr + 20, key->id, ENCFS_ID_SIZE);
+    if(key->version < 3){
+	return 0;
+    }
+    put_le64(hdr + HDR_SIZE_OFF, plain_size);
+    return aes_crypt_auth(key->ac, hdr + HDR_TAG_OFF, hdr, HDR_TAG_OFF) ?
+	0 : -EIO;
+}
+
+/* Plaintext size of the file on fd, whose backing file is disk_size bytes.
+ * Version 3 files take it from their header, which must verify and must
+ * not claim more chunks than the backing file holds; anything past the
+ * size it names is left over from a crash and ignored. Older files derive
+ * it from disk_size. */
+static off_t file_size(int fd, struct encfs_key* key, off_t disk_size){
+    unsigned char hdr[ENCFS_HEADER_SIZE];
+    unsigned char tag[AES_CRYPT_TAG_SIZE];
+    ssize_t res;
+    off_t size;
+
+    if(key->version < 3){
+	return encfs_plain_size(disk_size);
+    }
+    res = pread_full(fd, hdr, sizeof(hdr), 0);
+    if(res < 0){
+	return res;
+    }
+    if(res < ENCFS_HEADER_SIZE ||
+       !aes_crypt_auth(key->ac, tag, hdr, HDR_TAG_OFF) ||
+       CRYPTO_memcmp(tag, hdr + HDR_TAG_OFF, sizeof(tag))){
+	return -EIO;
+    }
+    size = get_le64(hdr + HDR_SIZE_OFF);
+    if(size < 0 || encfs_disk_size(size) > disk_size){
+	return -EIO;
+    }
+    return size;
+}
+
+/* Record plain_size in a version 3 header; older files have nowhere to */
+static int store_size(int fd, struct encfs_key* key, off_t plain_size){
+    unsigned char hdr[ENCFS_HEADER_SIZE];
+    ssize_t res;
+
+    if(key->version < 3){
+	return 0;
+    }
+    res = build_header(hdr, key, plain_size);
+    if(res == 0){
+	res = pwrite_full(fd, hdr, sizeof(hdr), 0);
+    }
+    return res < 0 ? res : 0;
+}
+
+/* Whether reads may decrypt just the bytes they return. A version 2 tag
+ * covers the whole chunk, so only version 1 CTR files qualify. */
+static int key_seekable(const struct encfs_key* key){
+    return key->ac->seekable && key->version < 2;
+}
+
+static off_t chunk_pos(off_t idx){
+    return ENCFS_HEADER_SIZE + idx * ENCFS_CHUNK_STRIDE;
+}
+
+/* Plaintext length of chunk idx in a file of plain_size bytes */
+static size_t chunk_len(off_t idx, off_t plain_size){
+    off_t left = plain_size - idx * ENCFS_CHUNK_SIZE;
+
+    if(left <= 0){
+	return 0;
+    }
+    return left < ENCFS_CHUNK_SIZE ? left : ENCFS_CHUNK_SIZE;
+}
+
+/* Encrypt len plaintext bytes as chunk idx into disk, appending a trailer
+ * with a fresh IV */
+static int encode_chunk(unsigned char* disk, const unsigned char* plain,
+			size_t len, struct encfs_key* key, off_t idx){
+    unsigned char* trailer = disk + len;
+    unsigned char aad[CHUNK_AAD_SIZE];
+
+    memset(trailer, 0, ENCFS_TRAILER_SIZE);
+    /* All zero and all HOLE_IV trailers mark holes, so never emit one */
+    do{
+	if(RAND_bytes(trailer, ENCFS_IV_SIZE) != 1){
+	    return -EIO;
+	}
+    }while(is_zero(trailer, ENCFS_IV_SIZE) || is_hole_iv(trailer));
+
+    if(!do_crypt_chunk_aad(key->ac, disk, plain, len, trailer,
+			   chunk_aad(key, idx, aad), aad_len(key),
+			   AES_ENCRYPT)){
+	return -EIO;
+    }
+    return 0;
+}
+
+/* Decrypt len byte chunk idx (data followed by its trailer) from disk */
+static int decode_chunk(unsigned char* plain, const unsigned char* disk,
+			size_t len, struct encfs_key* key, off_t idx){
+    unsigned char trailer[ENCFS_TRAILER_SIZE];
+    unsigned char aad[CHUNK_AAD_SIZE];
+    int hole;
+
+    memcpy(trailer, disk + len, sizeof(trailer));
+    hole = check_hole(trailer, key, idx);
+    if(hole < 0){
+	return hole;
+    }
+    if(hole){
+	memset(plain, 0, len);
+	return 0;
+    }
+    if(!do_crypt_chunk_aad(key->ac, plain, disk, len, trailer,
+			   chunk_aad(key, idx, aad), aad_len(key),
+			   AES_DECRYPT)){
+	return -EIO;
+    }
+    return 0;
+}
+
+static void encode_item(void* arg, size_t i){
+    struct crypt_batch* b = arg;
+    struct crypt_item* it = &b->items[i];
+
+    if(encode_chunk(it->out, it->in, it->len, b->key, it->idx) < 0){
+	__atomic_store_n(&b->err, -EIO, __ATOMIC_RELAXED);
+    }
+}
+
+/* Decrypt it->len bytes starting it->skip bytes into a chunk (always the
+ * whole chunk unless the key is seekable); a hole reads as zeros */
+static void decode_item(void* arg, size_t i){
+    struct crypt_batch* b = arg;
+    struct crypt_item* it = &b->items[i];
+    unsigned char trailer[ENCFS_TRAILER_SIZE];
+    unsigned char aad[CHUNK_AAD_SIZE];
+    int ok;
+
+    ok = check_hole(it->trailer, b->key, it->idx);
+    if(ok < 0){
+	__atomic_store_n(&b->err, -EIO, __ATOMIC_RELAXED);
+	return;
+    }
+    if(ok){
+	memset(it->out, 0, it->len);
+	return;
+    }
+    if(key_seekable(b->key)){
+	ok = do_crypt_buf(b->key->ac, it->out, it->in, it->len, it->trailer,
+			  it->skip, AES_DECRYPT);
+    }
+    else{
+	memcpy(trailer, it->trailer, sizeof(trailer));
+	ok = do_crypt_chunk_aad(b->key->ac, it->out, it->in, it->len, trailer,
+				chunk_aad(b->key, it->idx, aad),
+				aad_len(b->key), AES_DECRYPT);
+    }
+    if(!ok){
+	__atomic_store_n(&b->err, -EIO, __ATOMIC_RELAXED);
+    }
+}
+
+/* Run fn over the first n items of b, on the pool if there are enough */
+static int run_batch(struct crypt_batch* b, encfs_pool_fn fn, size_t n){
+    uint64_t start = encfs_stats_now();
+    size_t bytes = 0;
+    size_t i;
+
+    b->err = 0;
+    encfs_pool_run(n >= ENCFS_PARALLEL_CHUNKS ? crypt_pool : NULL, fn, b, n);
+    for(i = 0; i < n; i++){
+	bytes += b->items[i].len;
+    }
+    encfs_stats_add(ENCFS_STAT_CRYPTO, start, b->err, bytes);
+    return b->err;
+}
+
+/* Replace the whole contents of fd with len plaintext bytes from plain */
+static int encfs_rewrite(int fd, const unsigned char* plain, off_t len,
+			 struct encfs_key* key){
+    struct crypt_batch* batch;
+    unsigned char* disk;
+    size_t n;
+    off_t idx;
+    off_t nchunks = (len + ENCFS_CHUNK_SIZE - 1) / ENCFS_CHUNK_SIZE;
+    off_t first;
+    size_t dlen;
+    size_t clen;
+    ssize_t res;
+
+    res = encfs_init(fd, key);
+    if(res < 0){
+	return res;
+    }
+
+    disk = malloc(ENCFS_BATCH_CHUNKS * ENCFS_CHUNK_STRIDE);
+    batch = malloc(sizeof(*batch));
+    if(!disk || !batch){
+	free(disk);
+	free(batch);
+	return -ENOMEM;
+    }
+    batch->key = key;
+
+    for(first = 0; first < nchunks; first += ENCFS_BATCH_CHUNKS){
+	dlen = 0;
+	n = 0;
+	for(idx = first; idx < nchunks && idx < first + ENCFS_BATCH_CHUNKS; idx++){
+	    clen = chunk_len(idx, len);
+	    batch->items[n].out = disk + dlen;
+	    batch->items[n].in = plain + idx * ENCFS_CHUNK_SIZE;
+	    batch->items[n].idx = idx;
+	    batch->items[n++].len = clen;
+	    dlen += clen + ENCFS_TRAILER_SIZE;
+	}
+	res = run_batch(batch, encode_item, n);
+	if(res >= 0){
+	    res = pwrite_full(fd, disk, dlen, chunk_pos(first));
+	}
+	if(res < 0){
+	    free(disk);
+	    free(batch);
+	    return res;
+	}
+    }
+    free(disk);
+    free(batch);
+
+    if(ftruncate(fd, encfs_disk_size(len)) == -1){
+	return -errno;
+    }
+    return store_size(fd, key, len);
+}
+
+/* Decrypt chunk idx of a file holding plain_size bytes into a full chunk
+ * buffer, zero padding anything past the end of the chunk's data */
+static int load_chunk(int fd, off_t idx, off_t plain_size,
+		      unsigned char* plain, struct encfs_key* key){
+    unsigned char disk[ENCFS_CHUNK_STRIDE];
+    size_t clen = chunk_len(idx, plain_size);
+    uint64_t start;
+    ssize_t res;
+
+    memset(plain, 0, ENCFS_CHUNK_SIZE);
+    if(!clen){
+	return 0;
+    }
+    res = pread_full(fd, disk, clen + ENCFS_TRAILER_SIZE, chunk_pos(idx));
+    if(res < 0){
+	return res;
+    }
+    memset(disk + res, 0, clen + ENCFS_TRAILER_SIZE - res);
+    start = encfs_stats_now();
+    res = decode_chunk(plain, disk, clen, key, idx);
+    encfs_stats_add(ENCFS_STAT_CRYPTO, start, res, clen);
+    return res;
+}
+
+/* Encrypt the first len bytes of plain as chunk idx and write it out */
+static int store_chunk(int fd, off_t idx, const unsigned char* plain,
+		       size_t len, struct encfs_key* key){
+    unsigned char disk[ENCFS_CHUNK_STRIDE];
+    uint64_t start = encfs_stats_now();
+    ssize_t res;
+
+    res = encode_chunk(disk, plain, len, key, idx);
+    encfs_stats_add(ENCFS_STAT_CRYPTO, start, res, len);
+    if(res < 0){
+	return res;
+    }
+    res = pwrite_full(fd, disk, len + ENCFS_TRAILER_SIZE, chunk_pos(idx));
+    if(res < 0){
+	return res;
+    }
+    return 0;
+}
+
+/* Plaintext size of fd, writing a header first if the file has none yet */
+static off_t prepare_size(int fd, struct encfs_key* key){
+    struct stat st;
+    off_t size;
+    int res;
+
+    if(fstat(fd, &st) == -1){
+	return -errno;
+    }
+    if(st.st_size < ENCFS_HEADER_SIZE){
+	res = encfs_init(fd, key);
+	if(res < 0){
+	    return res;
+	}
+	return 0;
+    }
+    size = file_size(fd, key, st.st_size);
+    /* Drop whatever a crash left past the size a version 3 header names */
+    if(size >= 0 && key->version >= 3 &&
+       encfs_disk_size(size) < st.st_size &&
+       ftruncate(fd, encfs_disk_size(size)) == -1){
+	return -errno;
+    }
+    return size;
+}
+
+/* Make chunks first..last - 1 of a file of plain_size bytes holes. Before
+ * version 3 they are left unwritten, which reads as zeros; version 3 files
+ * get hole trailers (and zeros where the data would be) written instead. */
+static int write_holes(int fd, off_t first, off_t last, off_t plain_size,
+		       struct encfs_key* key){
+    unsigned char* disk;
+    off_t batch;
+    off_t idx;
+    size_t dlen;
+    size_t clen;
+    ssize_t res = 0;
+
+    if(key->version < 3 || first >= last){
+	return 0;
+    }
+    disk = malloc(ENCFS_BATCH_CHUNKS * ENCFS_CHUNK_STRIDE);
+    if(!disk){
+	return -ENOMEM;
+    }
+    for(batch = first; res >= 0 && batch < last;
+	batch += ENCFS_BATCH_CHUNKS){
+	dlen = 0;
+	for(idx = batch; idx < last && idx < batch + ENCFS_BATCH_CHUNKS;
+	    idx++){
+	    clen = chunk_len(idx, plain_size);
+	    memset(disk + dlen, 0, clen);
+	    res = make_hole(disk + dlen + clen, key, idx);
+	    if(res < 0){
+		break;
+	    }
+	    dlen += clen + ENCFS_TRAILER_SIZE;
+	}
+	if(res >= 0){
+	    res = pwrite_full(fd, disk, dlen, chunk_pos(batch));
+	}
+    }
+    free(disk);
+    return res < 0 ? res : 0;
+}
+
+/* Overwrite plaintext [offset, end) with encrypted zeros */
+static int write_zeros(int fd, off_t offset, off_t end, struct encfs_key* key){
+    char zero[ENCFS_CHUNK_SIZE];
+    ssize_t res;
+    size_t n;
+
+    memset(zero, 0, sizeof(zero));
+    while(offset < end){
+	n = end - offset < ENCFS_CHUNK_SIZE ? end - offset : ENCFS_CHUNK_SIZE;
+	res = encfs_pwrite(fd, zero, n, offset, key);
+	if(res < 0){
+	    return res;
+	}
+	offset += n;
+    }
+    return 0;
+}
+
+/* Index of the chunk whose stride holds backing offset pos */
+static off_t chunk_at(off_t pos){
+    return pos < ENCFS_HEADER_SIZE ? 0 :
+	(pos - ENCFS_HEADER_SIZE) / ENCFS_CHUNK_STRIDE;
+}
+
+/* encfs_lseek() for a file of known size. A chunk only counts as a hole
+ * when its whole stride lies in a hole of the backing file, so unwritten
+ * chunks sharing a filesystem block with written ones count as data. */
+static off_t seek_chunk(int fd, off_t offset, int whence, off_t disk_size,
+			off_t plain_size){
+    off_t from;
+    off_t pos;
+    off_t data;
+    off_t idx;
+
+    if(offset < 0 || offset >= plain_size){
+	return -ENXIO;
+    }
+    from = chunk_pos(offset / ENCFS_CHUNK_SIZE);
+
+    if(whence == SEEK_DATA){
+	pos = lseek(fd, from, SEEK_DATA);
+	if(pos == -1){
+	    return -errno;
+	}
+	idx = chunk_at(pos);
+	if(idx * ENCFS_CHUNK_SIZE <= offset){
+	    return offset;
+	}
+	return idx * ENCFS_CHUNK_SIZE < plain_size ?
+	    idx * ENCFS_CHUNK_SIZE : -ENXIO;
+    }
+
+    for(;;){
+	pos = lseek(fd, from, SEEK_HOLE);
+	if(pos == -1){
+	    return -errno;
+	}
+	/* The first chunk starting inside this backing hole */
+	idx = chunk_at(pos + ENCFS_CHUNK_STRIDE - 1);
+	if(pos >= disk_size || idx * ENCFS_CHUNK_SIZE >= plain_size){
+	    return plain_size;
+	}
+	data = lseek(fd, pos, SEEK_DATA);
+	if(data == -1){
+	    if(errno != ENXIO){
+		return -errno;
+	    }
+	    data = disk_size;
+	}
+	if(data >= chunk_pos(idx) + (off_t)chunk_len(idx, plain_size) +
+	   ENCFS_TRAILER_SIZE){
+	    return idx * ENCFS_CHUNK_SIZE > offset ?
+		idx * ENCFS_CHUNK_SIZE : offset;
+	}
+	from = data;
+    }
+}
+
+extern void encfs_set_pool(struct encfs_pool* pool){
+    crypt_pool = pool;
+}
+
+extern off_t encfs_plain_size(off_t disk_size){
+    off_t body;
+    off_t rem;
+
+    if(disk_size <= ENCFS_HEADER_SIZE){
+	return 0;
+    }
+    body = disk_size - ENCFS_HEADER_SIZE;
+    rem = body % ENCFS_CHUNK_STRIDE;
+
+    /* A tail no longer than its trailer can only come from a torn write */
+    return (body / ENCFS_CHUNK_STRIDE) * ENCFS_CHUNK_SIZE +
+	(rem > ENCFS_TRAILER_SIZE ? rem - ENCFS_TRAILER_SIZE : 0);
+}
+
+extern off_t encfs_disk_size(off_t plain_size){
+    off_t rem = plain_size % ENCFS_CHUNK_SIZE;
+
+    return ENCFS_HEADER_SIZE +
+	(plain_size / ENCFS_CHUNK_SIZE) * ENCFS_CHUNK_STRIDE +
+	(rem ? rem + ENCFS_TRAILER_SIZE : 0);
+}
+
+extern off_t encfs_lseek(int fd, off_t offset, int whence,
+			 struct encfs_key* key){
+    struct stat st;
+    off_t plain_size;
+
+    if(whence != SEEK_DATA && whence != SEEK_HOLE){
+	return -EINVAL;
+    }
+    if(fstat(fd, &st) == -1){
+	return -errno;
+    }
+    plain_size = file_size(fd, key, st.st_size);
+    if(plain_size < 0){
+	return plain_size;
+    }
+    /* Version 3 holes are written out, so the whole file is data */
+    if(key->version >= 3){
+	if(offset < 0 || offset >= plain_size){
+	    return -ENXIO;
+	}
+	return whence == SEEK_DATA ? offset : plain_size;
+    }
+    return seek_chunk(fd, offset, whence, st.st_size, plain_size);
+}
+
+extern int encfs_probe(int fd, int* mode, struct encfs_key* key){
+    struct stat st;
+    unsigned char hdr[ENCFS_HEADER_SIZE];
+    ssize_t res;
+
+    if(fstat(fd, &st) == -1){
+	return -errno;
+    }
+    if(st.st_size == 0){
+	return ENCFS_FMT_EMPTY;
+    }
+
+    res = pread_full(fd, hdr, sizeof(hdr), 0);
+    if(res < 0){
+	return res;
+    }
+    if(res < ENCFS_HEADER_SIZE ||
+       memcmp(hdr, ENCFS_MAGIC, sizeof(ENCFS_MAGIC))){
+	return ENCFS_FMT_LEGACY;
+    }
+    if(get_le32(hdr + 8) < 1 || get_le32(hdr + 8) > ENCFS_VERSION ||
+       get_le32(hdr + 12) != ENCFS_CHUNK_SIZE ||
+       get_le32(hdr + 16) >= AES_CRYPT_NMODES){
+	fprintf(stderr, "encfs: unsupported chunk format\n");
+	return -EINVAL;
+    }
+    *mode = get_le32(hdr + 16);
+    key->version = get_le32(hdr + 8);
+    memcpy(key->id, hdr + 20, ENCFS_ID_SIZE);
+    return ENCFS_FMT_CHUNKED;
+}
+
+extern int encfs_init(int fd, struct encfs_key* key){
+    unsigned char hdr[ENCFS_HEADER_SIZE];
+    struct encfs_key fresh = *key;
+    ssize_t res;
+
+    fresh.version = ENCFS_VERSION;
+    if(RAND_bytes(fresh.id, ENCFS_ID_SIZE) != 1){
+	return -EIO;
+    }
+    res = build_header(hdr, &fresh, 0);
+    if(res == 0){
+	res = pwrite_full(fd, hdr, sizeof(hdr), 0);
+    }
+    if(res < 0){
+	return res;
+    }
+    *key = fresh;
+    return 0;
+}
+
+extern int encfs_upgrade(int fd, struct encfs_key* key){
+    FILE* inFile;
+    FILE* outFile;
+    char* mtext = NULL;
+    size_t msize = 0;
+    int fd2;
+    int ok;
+    int res;
+
+    fd2 = dup(fd);
+    if(fd2 == -1){
+	return -errno;
+    }
+    inFile = fdopen(fd2, "rb");
+    if(!inFile){
+	res = -errno;
+	close(fd2);
+	return res;
+    }
+    outFile = open_memstream(&mtext, &msize);
+    if(!outFile){
+	res = -errno;
+	fclose(inFile);
+	return res;
+    }
+
+    rewind(inFile);
+    ok = do_crypt(inFile, outFile, AES_DECRYPT, key->ac->key_str);
+    fclose(inFile);
+    fclose(outFile);
+
+    if(!ok){
+	free(mtext);
+	return -EIO;
+    }
+    res = encfs_rewrite(fd, (unsigned char*)mtext, msize, key);
+    free(mtext);
+    return res;
+}
+
+extern ssize_t encfs_pread(int fd, char* buf, size_t size, off_t offset,
+			   struct encfs_key* key){
+    struct stat st;
+    struct crypt_batch* batch;
+    struct iovec iov[2 * ENCFS_BATCH_CHUNKS + 1];
+    unsigned char (*trailers)[ENCFS_TRAILER_SIZE];
+    struct crypt_item* it;
+    unsigned char gap[ENCFS_CHUNK_SIZE];
+    unsigned char edge[2][ENCFS_CHUNK_SIZE];
+    char* edge_dst[2];
+    size_t edge_skip[2];
+    size_t edge_len[2];
+    size_t tend[ENCFS_BATCH_CHUNKS];
+    off_t plain_size;
+    off_t pos;
+    off_t idx;
+    off_t first;
+    off_t last;
+    off_t lead;
+    off_t data;
+    size_t done = 0;
+    size_t dlen;
+    size_t clen;
+    size_t skip;
+    size_t n;
+    int seekable = key_seekable(key);
+    int niov;
+    int nedge;
+    int i;
+    uint64_t start;
+    ssize_t res;
+
+    if(fstat(fd, &st) == -1){
+	return -errno;
+    }
+    plain_size = file_size(fd, key, st.st_size);
+    if(plain_size < 0){
+	return plain_size;
+    }
+    if(offset >= plain_size){
+	return 0;
+    }
+    if((off_t)size > plain_size - offset){
+	size = plain_size - offset;
+    }
+    if(size == 0){
+	return 0;
+    }
+
+    trailers = malloc(ENCFS_BATCH_CHUNKS * ENCFS_TRAILER_SIZE);
+    batch = malloc(sizeof(*batch));
+    if(!trailers || !batch){
+	free(trailers);
+	free(batch);
+	return -ENOMEM;
+    }
+    batch->key = key;
+
+    while(done < size){
+	pos = offset + done;
+	first = pos / ENCFS_CHUNK_SIZE;
+	last = (offset + size - 1) / ENCFS_CHUNK_SIZE;
+	if(last - first >= ENCFS_BATCH_CHUNKS){
+	    last = first + ENCFS_BATCH_CHUNKS - 1;
+	}
+
+	/* Large reads skip holes in the backing file without reading or
+	 * decrypting them; small ones are not worth the extra lseek().
+	 * Version 3 holes are written out and checked like any chunk. */
+	if(key->version < 3 && last - first + 1 >= ENCFS_PARALLEL_CHUNKS){
+	    data = seek_chunk(fd, pos, SEEK_DATA, st.st_size, plain_size);
+	    if(data == -ENXIO){
+		data = offset + size;
+	    }
+	    if(data > pos){
+		n = data - pos;
+		if(n > size - done){
+		    n = size - done;
+		}
+		memset(buf + done, 0, n);
+		done += n;
+		continue;
+	    }
+	}
+
+	/* Covering chunks are contiguous on disk: scatter the ciphertext we
+	 * need straight into the caller's buffer and the trailers aside,
+	 * then decrypt in place. Modes that can only decrypt whole chunks
+	 * land a partly wanted first or last chunk in edge[] instead and
+	 * copy the wanted part out afterwards. */
+	niov = 0;
+	dlen = 0;
+	nedge = 0;
+	lead = seekable ? pos % ENCFS_CHUNK_SIZE : 0;
+	for(idx = first; idx <= last; idx++){
+	    i = idx - first;
+	    it = &batch->items[i];
+	    clen = chunk_len(idx, plain_size);
+	    skip = idx == first ? pos % ENCFS_CHUNK_SIZE : 0;
+	    n = clen - skip;
+	    if(n > size - done){
+		n = size - done;
+	    }
+	    if(!seekable && n < clen){
+		iov[niov].iov_base = edge[nedge];
+		iov[niov++].iov_len = clen;
+		it->out = edge[nedge];
+		it->len = clen;
+		it->skip = 0;
+		edge_dst[nedge] = buf + done;
+		edge_skip[nedge] = skip;
+		edge_len[nedge++] = n;
+		dlen += clen + ENCFS_TRAILER_SIZE;
+	    }
+	    else{
+		iov[niov].iov_base = buf + done;
+		iov[niov++].iov_len = n;
+		if(skip + n < clen){
+		    /* Only the last chunk of a request can end early */
+		    iov[niov].iov_base = gap;
+		    iov[niov++].iov_len = clen - skip - n;
+		}
+		it->out = (unsigned char*)buf + done;
+		it->len = n;
+		it->skip = skip;
+		dlen += clen - skip + ENCFS_TRAILER_SIZE;
+	    }
+	    it->in = it->out;
+	    it->idx = idx;
+	    it->trailer = trailers[i];
+	    iov[niov].iov_base = trailers[i];
+	    iov[niov++].iov_len = ENCFS_TRAILER_SIZE;
+	    tend[i] = dlen;
+	    done += n;
+	}
+
+	start = encfs_stats_now();
+	res = preadv(fd, iov, niov, chunk_pos(first) + lead);
+	if(res < 0){
+	    res = -errno;
+	}
+	encfs_stats_add(ENCFS_STAT_IO, start, res, res < 0 ? 0 : res);
+	if(res < 0){
+	    free(trailers);
+	    free(batch);
+	    return res;
+	}
+	/* Lost a race with a truncate: chunks whose trailer did not make
+	 * it are treated as unwritten (and as corrupt from version 3 on) */
+	for(i = 0; i <= last - first; i++){
+	    if(tend[i] > (size_t)res){
+		memset(trailers[i], 0, ENCFS_TRAILER_SIZE);
+	    }
+	}
+
+	if(run_batch(batch, decode_item, last - first + 1) < 0){
+	    free(trailers);
+	    free(batch);
+	    return -EIO;
+	}
+	for(i = 0; i < nedge; i++){
+	    memcpy(edge_dst[i], edge[i] + edge_skip[i], edge_len[i]);
+	}
+    }
+
+    free(trailers);
+    free(batch);
+    return done;
+}
+
+extern ssize_t encfs_pwrite(int fd, const char* buf, size_t size, off_t offset,
+			    struct encfs_key* key){
+    struct crypt_batch* items;
+    unsigned char* disk;
+    unsigned char plain[2][ENCFS_CHUNK_SIZE];
+    unsigned char hole[ENCFS_BATCH_CHUNKS];
+    unsigned char* src;
+    off_t plain_size;
+    off_t old_size;
+    off_t new_size;
+    off_t end = offset + size;
+    off_t tail;
+    off_t idx;
+    off_t first;
+    off_t last;
+    off_t batch;
+    off_t cstart;
+    size_t clen;
+    size_t lo;
+    size_t hi;
+    size_t dlen;
+    size_t n;
+    size_t i;
+    size_t run;
+    ssize_t res;
+
+    if(size == 0){
+	return 0;
+    }
+    plain_size = prepare_size(fd, key);
+    if(plain_size < 0){
+	return plain_size;
+    }
+    old_size = plain_size;
+    first = offset / ENCFS_CHUNK_SIZE;
+    last = (end - 1) / ENCFS_CHUNK_SIZE;
+
+    /* Only the last chunk may be short: fill out an old partial tail
+     * before writing past it. Whole chunks skipped over become holes. */
+    tail = plain_size / ENCFS_CHUNK_SIZE;
+    if(plain_size % ENCFS_CHUNK_SIZE && first > tail){
+	res = load_chunk(fd, tail, plain_size, plain[0], key);
+	if(res < 0){
+	    return res;
+	}
+	res = store_chunk(fd, tail, plain[0], ENCFS_CHUNK_SIZE, key);
+	if(res < 0){
+	    return res;
+	}
+	plain_size = (tail + 1) * ENCFS_CHUNK_SIZE;
+    }
+    new_size = end > plain_size ? end : plain_size;
+    res = write_holes(fd, (plain_size + ENCFS_CHUNK_SIZE - 1) / ENCFS_CHUNK_SIZE,
+		      first, new_size, key);
+    if(res < 0){
+	return res;
+    }
+
+    disk = malloc(ENCFS_BATCH_CHUNKS * ENCFS_CHUNK_STRIDE);
+    items = malloc(sizeof(*items));
+    if(!disk || !items){
+	free(disk);
+	free(items);
+	return -ENOMEM;
+    }
+    items->key = key;
+
+    for(batch = first; batch <= last; batch += ENCFS_BATCH_CHUNKS){
+	dlen = 0;
+	n = 0;
+	for(idx = batch; idx <= last && idx < batch + ENCFS_BATCH_CHUNKS; idx++){
+	    cstart = idx * ENCFS_CHUNK_SIZE;
+	    clen = chunk_len(idx, new_size);
+	    lo = (offset > cstart ? offset : cstart) - cstart;
+	    hi = (end < cstart + (off_t)clen ? end : cstart + (off_t)clen) - cstart;
+	    hole[idx - batch] = 0;
+
+	    /* Only the first and last chunk can be partially overwritten;
+	     * fully covered chunks are encrypted straight from buf */
+	    if(lo > 0 || hi < clen){
+		src = plain[idx == first ? 0 : 1];
+		res = load_chunk(fd, idx, plain_size, src, key);
+		if(res < 0){
+		    free(disk);
+		    free(items);
+		    return res;
+		}
+		memcpy(src + lo, buf + (cstart + lo - offset), hi - lo);
+	    }
+	    else{
+		src = (unsigned char*)buf + (cstart - offset);
+		/* Zeros written past the old end of file stay a hole */
+		if(cstart >= plain_size && is_zero(src, clen)){
+		    hole[idx - batch] = 1;
+		    dlen += clen + ENCFS_TRAILER_SIZE;
+		    continue;
+		}
+	    }
+	    items->items[n].in = src;
+	    items->items[n].idx = idx;
+	    items->items[n].out = disk + dlen;
+	    items->items[n++].len = clen;
+	    dlen += clen + ENCFS_TRAILER_SIZE;
+	}
+	res = run_batch(items, encode_item, n);
+
+	/* Write out each run of chunks between holes; every chunk but the
+	 * file's last is full, so chunk i sits at disk + i * stride */
+	n = idx - batch;
+	for(i = 0; res >= 0 && i < n; i += run){
+	    for(run = 0; i + run < n && hole[i] == hole[i + run]; run++){
+	    }
+	    if(!hole[i]){
+		res = pwrite_full(fd, disk + i * ENCFS_CHUNK_STRIDE,
+				  (i + run == n ? dlen : (i + run) *
+				   ENCFS_CHUNK_STRIDE) - i * ENCFS_CHUNK_STRIDE,
+				  chunk_pos(batch + i));
+	    }
+	    else{
+		res = write_holes(fd, batch + i, batch + i + run, new_size,
+				  key);
+	    }
+	}
+	if(res < 0){
+	    free(disk);
+	    free(items);
+	    return res;
+	}
+    }
+
+    free(disk);
+    free(items);
+
+    /* A hole at the end still has to extend the file */
+    if(hole[(last - first) % ENCFS_BATCH_CHUNKS] &&
+       ftruncate(fd, encfs_disk_size(new_size)) == -1){
+	return -errno;
+    }
+    /* The header names the new size only once every chunk is there */
+    if(new_size > old_size){
+	res = store_size(fd, key, new_size);
+	if(res < 0){
+	    return res;
+	}
+    }
+    return size;
+}
+
+extern int encfs_truncate(int fd, off_t size, struct encfs_key* key){
+    unsigned char plain[ENCFS_CHUNK_SIZE];
+    off_t plain_size;
+    off_t idx;
+    int res;
+
+    plain_size = prepare_size(fd, key);
+    if(plain_size < 0){
+	return plain_size;
+    }
+    if(size == plain_size){
+	return 0;
+    }
+
+    /* Only the chunk holding the new or old end of file changes length;
+     * anything added past it becomes holes and reads as zeros */
+    idx = (size < plain_size ? size : plain_size) / ENCFS_CHUNK_SIZE;
+    if(chunk_len(idx, plain_size) && chunk_len(idx, size) &&
+       chunk_len(idx, plain_size) != chunk_len(idx, size)){
+	res = load_chunk(fd, idx, plain_size, plain, key);
+	if(res < 0){
+	    return res;
+	}
+	res = store_chunk(fd, idx, plain, chunk_len(idx, size), key);
+	if(res < 0){
+	    return res;
+	}
+    }
+
+    /* The header never names more chunks than are on disk: it shrinks
+     * before the file does and grows after */
+    if(size < plain_size){
+	res = store_size(fd, key, size);
+    }
+    else{
+	res = write_holes(fd, (plain_size + ENCFS_CHUNK_SIZE - 1) /
+			  ENCFS_CHUNK_SIZE, (size + ENCFS_CHUNK_SIZE - 1) /
+			  ENCFS_CHUNK_SIZE, size, key);
+    }
+    if(res < 0){
+	return res;
+    }
+    if(ftruncate(fd, encfs_disk_size(size)) == -1){
+	return -errno;
+    }
+    return size > plain_size ? store_size(fd, key, size) : 0;
+}
+
+extern int encfs_fallocate(int fd, int mode, off_t offset, off_t len,
+			   struct encfs_key* key){
+    struct stat st;
+    off_t plain_size;
+    off_t end = offset + len;
+    off_t lo;
+    off_t hi;
+    off_t stop;
+    int res;
+
+    if(offset < 0 || len <= 0){
+	return -EINVAL;
+    }
+    if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE) ||
+       (mode & FALLOC_FL_PUNCH_HOLE && !(mode & FALLOC_FL_KEEP_SIZE))){
+	return -EOPNOTSUPP;
+    }
+    plain_size = prepare_size(fd, key);
+    if(plain_size < 0){
+	return plain_size;
+    }
+
+    /* Preallocated blocks read as zeros, so their chunks are unwritten
+     * ones; only a new end of file needs encfs_truncate() */
+    if(!(mode & FALLOC_FL_PUNCH_HOLE)){
+	lo = offset / ENCFS_CHUNK_SIZE;
+	hi = (end - 1) / ENCFS_CHUNK_SIZE + 1;
+	if(fallocate(fd, FALLOC_FL_KEEP_SIZE, chunk_pos(lo),
+		     chunk_pos(hi) - chunk_pos(lo)) == -1){
+	    return -errno;
+	}
+	if(!(mode & FALLOC_FL_KEEP_SIZE) && end > plain_size){
+	    return encfs_truncate(fd, end, key);
+	}
+	return 0;
+    }
+
+    if(offset >= plain_size){
+	return 0;
+    }
+    if(end > plain_size){
+	end = plain_size;
+    }
+
+    /* Chunks [lo, hi) are wholly inside the range and become holes, by
+     * punching out their stride, trailer included, before version 3 and by
+     * writing hole trailers over them from then on; the partly covered
+     * chunks at either end are rewritten with zeros */
+    lo = (offset + ENCFS_CHUNK_SIZE - 1) / ENCFS_CHUNK_SIZE;
+    hi = end == plain_size ? (end + ENCFS_CHUNK_SIZE - 1) / ENCFS_CHUNK_SIZE :
+	end / ENCFS_CHUNK_SIZE;
+    if(lo >= hi){
+	return write_zeros(fd, offset, end, key);
+    }
+    res = write_zeros(fd, offset, lo * ENCFS_CHUNK_SIZE, key);
+    if(res < 0){
+	return res;
+    }
+    if(hi * ENCFS_CHUNK_SIZE < end){
+	res = write_zeros(fd, hi * ENCFS_CHUNK_SIZE, end, key);
+	if(res < 0){
+	    return res;
+	}
+    }
+
+    if(key->version >= 3){
+	return write_holes(fd, lo, hi, plain_size, key);
+    }
+    if(fstat(fd, &st) == -1){
+	return -errno;
+    }
+    stop = chunk_pos(hi) < st.st_size ? chunk_pos(hi) : st.st_size;
+    if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, chunk_pos(lo),
+		 stop - chunk_pos(lo)) == -1){
+	return -errno;
+    }
+    return 0;
+}
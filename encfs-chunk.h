@@ -0,0 +1,156 @@
+/* encfs-chunk.h
+ * Chunked, randomly addressable on-disk format for pa4-encfs encrypted files
+ *
+ * An encrypted backing file is a small fixed header followed by a run of
+ * independently encrypted chunks:
+ *
+ *   | header | data 0 | trailer 0 | data 1 | trailer 1 | ... | data n | trailer n |
+ *
+ * Every chunk holds ENCFS_CHUNK_SIZE bytes of plaintext (only the last one may
+ * be shorter) encrypted with the cipher mode named in the header, followed by
+ * a trailer carrying the random IV the chunk was encrypted under and, for
+ * authenticated modes, its tag. No mode adds padding, so chunk i always
+ * starts at a fixed offset and, before version 3, the plaintext size follows
+ * directly from the backing file size. A byte range is therefore read or rewritten by touching
+ * only the chunks that cover it. In version 1 CTR files a read decrypts just
+ * the bytes it returns; everything else decrypts (and checks) whole chunks.
+ *
+ * Each file records its own mode, so one tree can mix files written under
+ * different -o cipher settings. Headers written before the mode field
+ * existed hold zero there, which is AES_CRYPT_CTR.
+ *
+ * Version 2 headers also carry a random file id, and every chunk's tag
+ * authenticates the id and the chunk's index along with its contents (as
+ * AEAD additional data for GCM and ChaCha20-Poly1305, through a GMAC in
+ * the otherwise unused tag space for CTR and XTS). A chunk that was
+ * altered, or copied from another position or another file, fails to
+ * decrypt with -EIO. Checking costs only the chunks a request touches;
+ * nothing ties the chunks to each other, so replaying an older version of
+ * a chunk at the same position, dropping whole chunks off the end, or
+ * zeroing a chunk into a hole still goes unnoticed. Version 1 files (no
+ * id, CTR and XTS unauthenticated) stay readable and writable as they are.
+ *
+ * Version 3 closes the last two gaps. The header also holds the plaintext
+ * size and a tag (aes_crypt_auth()) over every field before it, so the
+ * size cannot be changed and chunks cut off the end are missed, and the
+ * chunk aad names the version, so a version 3 file cannot be passed off as
+ * version 2. The header is rewritten after the chunks when the file grows
+ * and before they go when it shrinks; chunks past the size it names are
+ * crash leftovers, ignored and trimmed by the next write. Holes carry a
+ * trailer of their own (an all 0xff IV and a tag over the chunk's aad)
+ * and their zeros are written out, so they verify like any chunk and an
+ * all zero trailer is -EIO. Replaying an old copy of a single chunk at its
+ * own position is still not detected.
+ *
+ * Before version 3, a chunk whose trailer is all zero has never been
+ * written and reads back as zeros without being decrypted. Such holes come
+ * from extending the file with truncate or by writing past its end (chunks
+ * skipped over, and chunks written past the old end that are all zeros,
+ * are never stored), and from a crash while extending the file. Runs of
+ * them are holes in the backing file too, taking no disk space; large
+ * reads skip those without reading them, and encfs_lseek() finds them.
+ *
+ * Files written by the old whole-file CBC format (do_crypt) carry no header;
+ * encfs_probe() reports them as ENCFS_FMT_LEGACY and encfs_upgrade() rewrites
+ * them in place.
+ *
+ * All functions return 0 (or a byte count) on success and -errno on error so
+ * they can be returned straight from FUSE handlers.
+ */
+
+#ifndef ENCFS_CHUNK_H
+#define ENCFS_CHUNK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aes-crypt.h"
+
+#define ENCFS_MAGIC        "P4ENCFS"
+#define ENCFS_VERSION      3
+#define ENCFS_ID_SIZE      16
+#define ENCFS_HEADER_SIZE  64
+#define ENCFS_CHUNK_SIZE   4096
+#define ENCFS_IV_SIZE      AES_CRYPT_IV_SIZE
+#define ENCFS_TRAILER_SIZE (AES_CRYPT_IV_SIZE + AES_CRYPT_TAG_SIZE)
+#define ENCFS_CHUNK_STRIDE (ENCFS_CHUNK_SIZE + ENCFS_TRAILER_SIZE)
+
+/* Chunks moved per pread()/pwrite() on the backing file */
+#define ENCFS_BATCH_CHUNKS 256
+
+/* Batches of at least this many chunks are encrypted or decrypted on the
+ * worker pool given to encfs_set_pool(); smaller ones are not worth the
+ * wakeups */
+#define ENCFS_PARALLEL_CHUNKS 16
+
+/* encfs_probe() results */
+#define ENCFS_FMT_EMPTY   0
+#define ENCFS_FMT_CHUNKED 1
+#define ENCFS_FMT_LEGACY  2
+
+struct encfs_pool;
+
+/* How a file's chunks are encrypted: the cipher its header names, its
+ * format version and, from version 2 on, the id its chunk tags are bound
+ * to. encfs_probe() and encfs_init() fill in version and id; ac is the
+ * caller's to set. */
+struct encfs_key {
+    struct aes_crypt* ac;
+    int version;
+    unsigned char id[ENCFS_ID_SIZE];
+};
+
+/* Spread the cipher work of large reads and writes over pool (NULL to do
+ * it all on the calling thread). Set once before any other call. */
+extern void encfs_set_pool(struct encfs_pool* pool);
+
+/* Plaintext size of a chunked file whose backing file is disk_size bytes */
+extern off_t encfs_plain_size(off_t disk_size);
+
+/* Backing file size of a chunked file holding plain_size bytes */
+extern off_t encfs_disk_size(off_t plain_size);
+
+/* Classify the backing file behind fd as empty, chunked or legacy CBC,
+ * storing the AES_CRYPT_* mode of a chunked file in *mode and its version
+ * and id in key */
+extern int encfs_probe(int fd, int* mode, struct encfs_key* key);
+
+/* Write a fresh header for key->ac's mode and a new id to fd, leaving an
+ * empty chunked file of the current version, and update key to match */
+extern int encfs_init(int fd, struct encfs_key* key);
+
+/* Convert a legacy whole-file CBC backing file to the chunked format */
+extern int encfs_upgrade(int fd, struct encfs_key* key);
+
+/* Read up to size plaintext bytes at offset, decrypting only covering chunks */
+extern ssize_t encfs_pread(int fd, char* buf, size_t size, off_t offset,
+			   struct encfs_key* key);
+
+/* Write size plaintext bytes at offset, re-encrypting only the chunks the
+ * range overlaps and extending the file if needed */
+extern ssize_t encfs_pwrite(int fd, const char* buf, size_t size, off_t offset,
+			    struct encfs_key* key);
+
+/* lseek(2) with SEEK_DATA or SEEK_HOLE on the plaintext: the offset of the
+ * next data or hole at or after offset, or -ENXIO if offset is at or past
+ * the end of file. Holes are found at chunk granularity through the
+ * backing file's own, so a lone unwritten chunk that shares filesystem
+ * blocks with written ones counts as data, as SEEK_DATA allows. Version 3
+ * holes are stored, so such files are all data. */
+extern off_t encfs_lseek(int fd, off_t offset, int whence,
+			 struct encfs_key* key);
+
+/* Set the plaintext size of the file to size, touching at most the chunk
+ * that holds the old or new end of file */
+extern int encfs_truncate(int fd, off_t size, struct encfs_key* key);
+
+/* fallocate(2) on the plaintext. Mode 0 and FALLOC_FL_KEEP_SIZE reserve
+ * backing space for the chunks covering the range, growing the file in
+ * the first case, without writing them. FALLOC_FL_PUNCH_HOLE (with
+ * FALLOC_FL_KEEP_SIZE) punches out the chunks wholly inside the range and
+ * rewrites the partly covered ones at its ends with zeros. Other modes
+ * fail with -EOPNOTSUPP. */
+extern int encfs_fallocate(int fd, int mode, off_t offset, off_t len,
+			   struct encfs_key* key);
+
+#endif
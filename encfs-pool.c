@@ -0,0 +1,184 @@
+/* encfs-pool.c
+ * Fixed pool of worker threads for data parallel pa4-encfs work
+ *
+ * See encfs-pool.h for the interface.
+ *
+ * Running jobs sit on a FIFO list under the pool lock. A job's items are
+ * claimed by bumping job->next atomically, so the lock is only taken to
+ * join and leave a job, never per item. The caller owns the job (it lives
+ * on its stack) and may only return once no worker still refers to it,
+ * which job->users counts.
+ *
+ */
+
+#include "encfs-pool.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+struct encfs_pool_job {
+    encfs_pool_fn fn;
+    void* arg;
+    size_t n;
+    size_t next;
+    int users;
+    int queued;
+    struct encfs_pool_job* qnext;
+};
+
+struct encfs_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    struct encfs_pool_job* head;
+    struct encfs_pool_job** tail;
+    int stop;
+    int nthreads;
+    pthread_t* threads;
+};
+
+/* Run items of job until none are left */
+static void drain(struct encfs_pool_job* job){
+    size_t i;
+
+    while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n){
+	job->fn(job->arg, i);
+    }
+}
+
+/* Take job off the run list if it is still there. Caller holds the lock. */
+static void dequeue(struct encfs_pool* pool, struct encfs_pool_job* job){
+    struct encfs_pool_job** pp;
+
+    if(!job->queued){
+	return;
+    }
+    for(pp = &pool->head; *pp != job; pp = &(*pp)->qnext){
+	;
+    }
+    *pp = job->qnext;
+    if(pool->tail == &job->qnext){
+	pool->tail = pp;
+    }
+    job->queued = 0;
+}
+
+static void* worker(void* arg){
+    struct encfs_pool* pool = arg;
+    struct encfs_pool_job* job;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;){
+	while(!pool->head && !pool->stop){
+	    pthread_cond_wait(&pool->work, &pool->lock);
+	}
+	if(pool->stop){
+	    break;
+	}
+	job = pool->head;
+	job->users++;
+	pthread_mutex_unlock(&pool->lock);
+
+	drain(job);
+
+	pthread_mutex_lock(&pool->lock);
+	/* Every item is claimed, so nobody else needs to find it */
+	dequeue(pool, job);
+	if(--job->users == 0){
+	    pthread_cond_broadcast(&pool->idle);
+	}
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+extern struct encfs_pool* encfs_pool_new(int nthreads){
+    struct encfs_pool* pool;
+    int i;
+
+    if(nthreads < 1){
+	return NULL;
+    }
+    pool = calloc(1, sizeof(*pool));
+    if(!pool){
+	return NULL;
+    }
+    pool->threads = calloc(nthreads, sizeof(*pool->threads));
+    if(!pool->threads){
+	free(pool);
+	return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->tail = &pool->head;
+
+    for(i = 0; i < nthreads; i++){
+	if(pthread_create(&pool->threads[i], NULL, worker, pool)){
+	    break;
+	}
+    }
+    pool->nthreads = i;
+    if(!i){
+	encfs_pool_free(pool);
+	return NULL;
+    }
+    return pool;
+}
+
+extern void encfs_pool_free(struct encfs_pool* pool){
+    int i;
+
+    if(!pool){
+	return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for(i = 0; i < pool->nthreads; i++){
+	pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+extern void encfs_pool_run(struct encfs_pool* pool, encfs_pool_fn fn,
+			   void* arg, size_t n){
+    struct encfs_pool_job job;
+    size_t i;
+
+    if(!pool || n < 2){
+	for(i = 0; i < n; i++){
+	    fn(arg, i);
+	}
+	return;
+    }
+
+    job.fn = fn;
+    job.arg = arg;
+    job.n = n;
+    job.next = 0;
+    job.users = 0;
+    job.queued = 1;
+    job.qnext = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    *pool->tail = &job;
+    pool->tail = &job.qnext;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    drain(&job);
+
+    pthread_mutex_lock(&pool->lock);
+    dequeue(pool, &job);
+    while(job.users){
+	pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
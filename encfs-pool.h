@@ -0,0 +1,35 @@
+/* encfs-pool.h
+ * Fixed pool of worker threads for data parallel pa4-encfs work
+ *
+ * encfs_pool_run() splits a job into n independent items and runs them on
+ * the pool's workers and the calling thread at once, returning when every
+ * item is done. Items are handed out one at a time from a shared atomic
+ * counter, so a worker that finishes early simply claims the next item and
+ * uneven items balance out without any per-item locking. Several threads
+ * may run jobs on one pool concurrently; idle workers join the oldest job
+ * that still has items left.
+ *
+ * Items must not depend on each other: they run in no particular order.
+ */
+
+#ifndef ENCFS_POOL_H
+#define ENCFS_POOL_H
+
+#include <stddef.h>
+
+struct encfs_pool;
+
+typedef void (*encfs_pool_fn)(void* arg, size_t item);
+
+/* Start a pool of nthreads workers, or return NULL on error */
+extern struct encfs_pool* encfs_pool_new(int nthreads);
+
+/* Stop and join the workers; no job may be running */
+extern void encfs_pool_free(struct encfs_pool* pool);
+
+/* Call fn(arg, i) for every i in [0, n) and wait for all of them. A NULL
+ * pool runs the items on the calling thread. */
+extern void encfs_pool_run(struct encfs_pool* pool, encfs_pool_fn fn,
+			   void* arg, size_t n);
+
+#endif
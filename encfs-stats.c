@@ -0,0 +1,163 @@
+/* encfs-stats.c
+ * Lock-free operation counters and latency histograms for pa4-encfs
+ *
+ * See encfs-stats.h for the interface.
+ *
+ * The snapshot is plain text meant for scripts: one summary line per
+ * statistic that has been used, then one line per histogram listing only
+ * its non-empty buckets as <upper bound in ns>:<count>.
+ *
+ */
+
+#include "encfs-stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+struct encfs_stat {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t ns;
+    uint64_t hist[ENCFS_HIST_BUCKETS];
+};
+
+static const char* stat_names[ENCFS_STAT_COUNT] = {
+    [ENCFS_STAT_GETATTR]  = "getattr",
+    [ENCFS_STAT_READDIR]  = "readdir",
+    [ENCFS_STAT_OPEN]     = "open",
+    [ENCFS_STAT_CREATE]   = "create",
+    [ENCFS_STAT_READ]     = "read",
+    [ENCFS_STAT_WRITE]    = "write",
+    [ENCFS_STAT_FLUSH]    = "flush",
+    [ENCFS_STAT_RELEASE]  = "release",
+    [ENCFS_STAT_FSYNC]    = "fsync",
+    [ENCFS_STAT_TRUNCATE] = "truncate",
+    [ENCFS_STAT_UNLINK]   = "unlink",
+    [ENCFS_STAT_RENAME]   = "rename",
+    [ENCFS_STAT_FALLOCATE] = "fallocate",
+    [ENCFS_STAT_CRYPTO]   = "crypto",
+    [ENCFS_STAT_IO]       = "io",
+};
+
+static struct encfs_stat stats[ENCFS_STAT_COUNT];
+
+static int bucket(uint64_t ns){
+    int b;
+
+    if(!ns){
+	return 0;
+    }
+    b = 63 - __builtin_clzll(ns);
+    return b < ENCFS_HIST_BUCKETS ? b : ENCFS_HIST_BUCKETS - 1;
+}
+
+/* Upper bound in microseconds of the bucket holding quantile q of hist */
+static double quantile_us(const uint64_t* hist, uint64_t calls, double q){
+    uint64_t want = (uint64_t)(q * calls);
+    uint64_t seen = 0;
+    int i;
+
+    for(i = 0; i < ENCFS_HIST_BUCKETS; i++){
+	seen += hist[i];
+	if(seen > want){
+	    break;
+	}
+    }
+    if(i == ENCFS_HIST_BUCKETS){
+	i--;
+    }
+    return (double)(2ULL << i) / 1000;
+}
+
+extern uint64_t encfs_stats_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+extern void encfs_stats_add(int stat, uint64_t start, int err, size_t bytes){
+    struct encfs_stat* s = &stats[stat];
+    uint64_t ns = encfs_stats_now() - start;
+
+    __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+    if(err < 0){
+	__atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+    }
+    if(bytes){
+	__atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&s->ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->hist[bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+extern const char* encfs_stats_name(int stat){
+    return stat_names[stat];
+}
+
+extern int encfs_stats_lookup(const char* name){
+    int i;
+
+    for(i = 0; i < ENCFS_STAT_COUNT; i++){
+	if(!strcmp(stat_names[i], name)){
+	    return i;
+	}
+    }
+    return -1;
+}
+
+extern size_t encfs_stats_format(char* buf, size_t size){
+    struct encfs_stat snap[ENCFS_STAT_COUNT];
+    size_t len = 0;
+    int i;
+    int b;
+
+#define OUT(...) \
+    len += snprintf(len < size ? buf + len : NULL, \
+		    len < size ? size - len : 0, __VA_ARGS__)
+
+    for(i = 0; i < ENCFS_STAT_COUNT; i++){
+	snap[i].calls = __atomic_load_n(&stats[i].calls, __ATOMIC_RELAXED);
+	snap[i].errors = __atomic_load_n(&stats[i].errors, __ATOMIC_RELAXED);
+	snap[i].bytes = __atomic_load_n(&stats[i].bytes, __ATOMIC_RELAXED);
+	snap[i].ns = __atomic_load_n(&stats[i].ns, __ATOMIC_RELAXED);
+	for(b = 0; b < ENCFS_HIST_BUCKETS; b++){
+	    snap[i].hist[b] = __atomic_load_n(&stats[i].hist[b],
+					      __ATOMIC_RELAXED);
+	}
+    }
+
+    OUT("# name calls errors bytes total_us p50_us p99_us\n");
+    for(i = 0; i < ENCFS_STAT_COUNT; i++){
+	if(!snap[i].calls){
+	    continue;
+	}
+	OUT("%s %llu %llu %llu %llu %.1f %.1f\n", stat_names[i],
+	    (unsigned long long)snap[i].calls,
+	    (unsigned long long)snap[i].errors,
+	    (unsigned long long)snap[i].bytes,
+	    (unsigned long long)(snap[i].ns / 1000),
+	    quantile_us(snap[i].hist, snap[i].calls, 0.50),
+	    quantile_us(snap[i].hist, snap[i].calls, 0.99));
+    }
+
+    OUT("# hist name le_ns:count ...\n");
+    for(i = 0; i < ENCFS_STAT_COUNT; i++){
+	if(!snap[i].calls){
+	    continue;
+	}
+	OUT("hist %s", stat_names[i]);
+	for(b = 0; b < ENCFS_HIST_BUCKETS; b++){
+	    if(snap[i].hist[b]){
+		OUT(" %llu:%llu", 2ULL << b,
+		    (unsigned long long)snap[i].hist[b]);
+	    }
+	}
+	OUT("\n");
+    }
+
+#undef OUT
+    return len;
+}
@@ -0,0 +1,57 @@
+/* encfs-stats.h
+ * Lock-free operation counters and latency histograms for pa4-encfs
+ *
+ * Every statistic counts calls, failed calls, bytes moved and total time,
+ * and keeps a histogram of latencies in power of two buckets: bucket i
+ * holds calls that took [2^i, 2^(i+1)) nanoseconds. Updates are relaxed
+ * atomic adds, so recording is safe and cheap from any thread; a snapshot
+ * taken while calls are in flight may be off by those calls.
+ *
+ * Besides the FUSE operations, ENCFS_STAT_CRYPTO and ENCFS_STAT_IO split
+ * the time encrypted reads and writes spend in the cipher from the time
+ * they spend in backing file I/O.
+ */
+
+#ifndef ENCFS_STATS_H
+#define ENCFS_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ENCFS_STAT_GETATTR  0
+#define ENCFS_STAT_READDIR  1
+#define ENCFS_STAT_OPEN     2
+#define ENCFS_STAT_CREATE   3
+#define ENCFS_STAT_READ     4
+#define ENCFS_STAT_WRITE    5
+#define ENCFS_STAT_FLUSH    6
+#define ENCFS_STAT_RELEASE  7
+#define ENCFS_STAT_FSYNC    8
+#define ENCFS_STAT_TRUNCATE 9
+#define ENCFS_STAT_UNLINK   10
+#define ENCFS_STAT_RENAME   11
+#define ENCFS_STAT_FALLOCATE 12
+#define ENCFS_STAT_CRYPTO   13
+#define ENCFS_STAT_IO       14
+#define ENCFS_STAT_COUNT    15
+
+#define ENCFS_HIST_BUCKETS  40
+
+/* Monotonic clock in nanoseconds, for passing to encfs_stats_add() */
+extern uint64_t encfs_stats_now(void);
+
+/* Count one call of stat that started at start (from encfs_stats_now()),
+ * moved bytes bytes and failed if err is negative */
+extern void encfs_stats_add(int stat, uint64_t start, int err, size_t bytes);
+
+/* Name of stat as used in snapshots and traces, e.g. "getattr" */
+extern const char* encfs_stats_name(int stat);
+
+/* Inverse of encfs_stats_name(), or -1 for an unknown name */
+extern int encfs_stats_lookup(const char* name);
+
+/* Write a text snapshot of every statistic to buf, snprintf() style:
+ * returns the length the full snapshot needs, which may exceed size */
+extern size_t encfs_stats_format(char* buf, size_t size);
+
+#endif
@@ -0,0 +1,196 @@
+/* encfs-trace.c
+ * Asynchronous operation trace for pa4-encfs
+ *
+ * See encfs-trace.h for the interface and the output format.
+ *
+ * The ring follows the usual bounded queue with per-slot sequence numbers:
+ * slot i is free for the producer claiming position p when its seq equals
+ * p, and holds a record for the reader at position p once its seq is p + 1.
+ * Producers claim positions with a compare-and-swap on tail; the single
+ * writer thread consumes from head, which only it touches.
+ *
+ */
+
+#include "encfs-trace.h"
+#include "encfs-stats.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+/* How long the writer sleeps when the ring is empty */
+#define TRACE_IDLE_NS 10000000
+
+struct trace_rec {
+    uint64_t start;
+    uint64_t ns;
+    uint64_t hash;
+    uint64_t hash2;
+    int64_t offset;
+    uint64_t size;
+    int32_t res;
+    int32_t op;
+};
+
+struct trace_slot {
+    uint64_t seq;
+    struct trace_rec rec;
+};
+
+struct encfs_trace {
+    FILE* out;
+    struct trace_slot* slots;
+    size_t mask;
+    uint64_t epoch;
+    uint64_t tail;
+    uint64_t head;
+    uint64_t dropped;
+    uint64_t reported;
+    int stop;
+    pthread_t thread;
+};
+
+/* Write out every record queued so far; returns how many there were */
+static size_t drain(struct encfs_trace* t){
+    struct trace_slot* slot;
+    struct trace_rec* r;
+    uint64_t dropped;
+    size_t n = 0;
+
+    for(;;){
+	slot = &t->slots[t->head & t->mask];
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != t->head + 1){
+	    break;
+	}
+	r = &slot->rec;
+	fprintf(t->out, "%llu %s %016llx %016llx %lld %llu %llu %d\n",
+		(unsigned long long)r->start, encfs_stats_name(r->op),
+		(unsigned long long)r->hash, (unsigned long long)r->hash2,
+		(long long)r->offset, (unsigned long long)r->size,
+		(unsigned long long)r->ns, r->res);
+	__atomic_store_n(&slot->seq, t->head + t->mask + 1, __ATOMIC_RELEASE);
+	t->head++;
+	n++;
+    }
+
+    dropped = __atomic_load_n(&t->dropped, __ATOMIC_RELAXED);
+    if(dropped != t->reported){
+	fprintf(t->out, "# dropped %llu records\n",
+		(unsigned long long)(dropped - t->reported));
+	t->reported = dropped;
+    }
+    return n;
+}
+
+static void* writer(void* arg){
+    struct encfs_trace* t = arg;
+    struct timespec idle = { 0, TRACE_IDLE_NS };
+
+    while(!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)){
+	if(!drain(t)){
+	    fflush(t->out);
+	    nanosleep(&idle, NULL);
+	}
+    }
+    drain(t);
+    fflush(t->out);
+    return NULL;
+}
+
+extern struct encfs_trace* encfs_trace_new(FILE* out, size_t nrecords){
+    struct encfs_trace* t;
+    size_t n = 2;
+    size_t i;
+
+    while(n < nrecords){
+	n <<= 1;
+    }
+    t = calloc(1, sizeof(*t));
+    if(!t){
+	return NULL;
+    }
+    t->slots = calloc(n, sizeof(*t->slots));
+    if(!t->slots){
+	free(t);
+	return NULL;
+    }
+    for(i = 0; i < n; i++){
+	t->slots[i].seq = i;
+    }
+    t->out = out;
+    t->mask = n - 1;
+    t->epoch = encfs_stats_now();
+
+    fprintf(out, "# pa4-encfs trace: start_ns op path path2 offset size"
+	    " ns result\n");
+    if(pthread_create(&t->thread, NULL, writer, t)){
+	free(t->slots);
+	free(t);
+	return NULL;
+    }
+    return t;
+}
+
+extern void encfs_trace_free(struct encfs_trace* t){
+    if(!t){
+	return;
+    }
+    __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(t->thread, NULL);
+    free(t->slots);
+    free(t);
+}
+
+extern void encfs_trace_add(struct encfs_trace* t, int op,
+			    const char* path, const char* path2,
+			    uint64_t start, int res, int64_t offset,
+			    uint64_t size){
+    struct trace_slot* slot;
+    uint64_t end = encfs_stats_now();
+    uint64_t pos;
+    uint64_t seq;
+
+    pos = __atomic_load_n(&t->tail, __ATOMIC_RELAXED);
+    for(;;){
+	slot = &t->slots[pos & t->mask];
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if(seq == pos){
+	    if(__atomic_compare_exchange_n(&t->tail, &pos, pos + 1, 1,
+					   __ATOMIC_RELAXED,
+					   __ATOMIC_RELAXED)){
+		break;
+	    }
+	}
+	else if((int64_t)(seq - pos) < 0){
+	    /* Full: the writer has not caught up with a whole ring ago */
+	    __atomic_fetch_add(&t->dropped, 1, __ATOMIC_RELAXED);
+	    return;
+	}
+	else{
+	    pos = __atomic_load_n(&t->tail, __ATOMIC_RELAXED);
+	}
+    }
+
+    slot->rec.start = start - t->epoch;
+    slot->rec.ns = end - start;
+    slot->rec.hash = encfs_trace_hash(path);
+    slot->rec.hash2 = encfs_trace_hash(path2);
+    slot->rec.offset = offset;
+    slot->rec.size = size;
+    slot->rec.res = res;
+    slot->rec.op = op;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+extern uint64_t encfs_trace_hash(const char* path){
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    if(!path){
+	return 0;
+    }
+    while(*path){
+	h ^= (unsigned char)*path++;
+	h *= 0x100000001b3ULL;
+    }
+    return h;
+}
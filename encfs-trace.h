@@ -0,0 +1,54 @@
+/* encfs-trace.h
+ * Asynchronous operation trace for pa4-encfs
+ *
+ * encfs_trace_add() copies one finished operation into a fixed size ring
+ * and returns; a background thread drains the ring to a stdio stream. The
+ * ring is a bounded multi-producer queue with a sequence number per slot,
+ * so producers never take a lock or wait on the writer. When the writer
+ * falls behind, new records are dropped and counted instead, and the gap
+ * is noted in the output.
+ *
+ * Each record is one text line:
+ *
+ *   <start ns> <op> <path hash> <path2 hash> <offset> <size> <ns> <result>
+ *
+ * start is relative to encfs_trace_new(), op is an encfs-stats name, and
+ * paths are reduced to 64-bit FNV-1a hashes (path2 is rename's target,
+ * else 0) so traces can be shared without leaking file names. offset and
+ * size are the request's, except that truncate puts the new length in
+ * offset, open/create put the open flags in size, fsync puts its
+ * datasync flag there and fallocate puts its mode in the bits of size
+ * from ENCFS_TRACE_MODE_SHIFT up. Lines starting with '#' are comments.
+ * encfs-bench -r replays such a trace.
+ */
+
+#ifndef ENCFS_TRACE_H
+#define ENCFS_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Where fallocate's mode starts in a record's size */
+#define ENCFS_TRACE_MODE_SHIFT 56
+
+struct encfs_trace;
+
+/* Start tracing to out through a ring of at least nrecords records, or
+ * return NULL on error. out must stay open until encfs_trace_free(). */
+extern struct encfs_trace* encfs_trace_new(FILE* out, size_t nrecords);
+
+/* Write out everything still queued and stop the writer thread */
+extern void encfs_trace_free(struct encfs_trace* trace);
+
+/* Queue one operation of type op (an ENCFS_STAT_* value) that started at
+ * start (from encfs_stats_now()) and returned res */
+extern void encfs_trace_add(struct encfs_trace* trace, int op,
+			    const char* path, const char* path2,
+			    uint64_t start, int res, int64_t offset,
+			    uint64_t size);
+
+/* 64-bit FNV-1a hash of path, 0 for NULL */
+extern uint64_t encfs_trace_hash(const char* path);
+
+#endif
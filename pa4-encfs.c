@@ -12,13 +12,21 @@
 
   gcc -Wall `pkg-config fuse --cflags` fusep4.c -o fusep4 `pkg-config fuse --libs`
 
-  Note: This implementation is largely stateless and does not maintain
-        open file handels between open and release calls (fi->fh).
-        Instead, files are opened and closed as necessary inside read(), write(),
-        etc calls. As such, the functions that rely on maintaining file handles are
-        not implmented (fgetattr(), etc). Those seeking a more efficient and
-        more complete implementation may wish to add fi->fh support to minimize
-        open() and close() calls and support fh dependent functions.
+  Note: Each open() and create() allocates a struct p4_file that is kept in
+        fi->fh until release(). It holds the backing file descriptor and
+        whether the file is encrypted, so read(), write() and the other fh
+        based calls (fgetattr(), ftruncate(), flush()) never re-resolve the
+        path or re-read the user.encrypted attribute.
+
+  Note: /.encfs-stats is a read-only virtual file holding the operation
+        counters and latency histograms from encfs-stats.h. It is not
+        listed by readdir() and hides any backing file of that name.
+        SIGUSR1 appends the same snapshot to -o logfile (or stderr).
+        With -o trace every counted operation is also logged there, in
+        the format described in encfs-trace.h.
+
+  Encrypted files are stored in the chunked format described in
+  encfs-chunk.h, so reads and writes only decrypt the chunks they touch.
 
 */
 
@@ -40,6 +48,8 @@
 #ifdef linux
 /* For pread()/pwrite() */
 #define _XOPEN_SOURCE 700
+/* For fallocate() */
+#define _GNU_SOURCE
 #endif
 
 #include <fuse.h>
@@ -50,25 +60,195 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <libgen.h>
 
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "aes-crypt.h"
+#include "encfs-chunk.h"
+#include "encfs-cache.h"
+#include "encfs-pool.h"
+#include "encfs-stats.h"
+#include "encfs-trace.h"
 
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 
+#define P4_INODE_BUCKETS 1024
+
+/* State shared by every handle open on one backing inode, so handles
+   opened through different paths or hard links serialize on one lock.
+   read() holds lock shared, so readers of a file run in parallel;
+   write(), truncate() and format upgrades hold it exclusive.
+
+   Small writes are gathered in a write-back buffer holding one dirty
+   extent, [wb_off, wb_off + wb_len), that is not on disk yet. It lives
+   here rather than in a handle so every handle on the file reads it.
+   wb_fd is a descriptor of our own to flush it through (-1 when clean);
+   wb_err keeps a failed flush to report from the next flush or fsync.
+
+   key holds the cipher, version and id the file's header names; key.ac
+   is set by p4_inode_format() and NULL until then.
+
+   encrypted caches the user.encrypted decision for as long as the inode
+   is open (-1 while unknown). It is guarded by inodes_lock rather than
+   lock, so a lookup never waits behind a write; only a change to the
+   attribute through p4_setxattr()/p4_removexattr() resets it. */
+struct p4_inode {
+	dev_t dev;
+	ino_t ino;
+	int refs;
+	int encrypted;
+	pthread_rwlock_t lock;
+	struct encfs_key key;
+	char *wb_buf;
+	off_t wb_off;
+	size_t wb_len;
+	int wb_fd;
+	int wb_err;
+	struct p4_inode *next;
+};
+
+#define P4_ATTR_SLOTS 4096
+
+/* Remembers whether a backing inode carries user.encrypted, so getattr()
+   can report plaintext sizes without a getxattr() per call, and whether
+   it is already in the chunked format (-1 while unknown). A slot is only
+   trusted while the inode's ctime is unchanged; setting or removing an
+   xattr or rewriting the file always bumps ctime, so a hit is never
+   stale.
+
+   open_ctime is the inode's ctime when it was last opened or changed
+   through the mount, and so the age of whatever page data the kernel
+   may still hold for it: see p4_keep_cache(). */
+struct p4_attr_slot {
+	dev_t dev;
+	ino_t ino;
+	struct timespec ctime;
+	struct timespec open_ctime;
+	int encrypted;
+	int chunked;
+};
+
 struct p4_state {
     FILE *logfile;
+    char *logfile_name;
     char *key_phrase;
     char *rootdir;
+    struct aes_crypt ciphers[AES_CRYPT_NMODES];
+    char *cipher_name;
+    int new_mode;
+    pthread_mutex_t inodes_lock;
+    struct p4_inode *inodes[P4_INODE_BUCKETS];
+    unsigned long cache_mb;
+    struct encfs_cache *cache;
+    pthread_mutex_t attrs_lock;
+    struct p4_attr_slot attrs[P4_ATTR_SLOTS];
+    unsigned long readahead_kb;
+    unsigned long writeback_kb;
+    unsigned long crypt_threads;
+    struct encfs_pool *pool;
+    pthread_mutex_t ra_lock;
+    pthread_cond_t ra_cond;
+    struct p4_readahead *ra_head;
+    struct p4_readahead **ra_tail;
+    int ra_queued;
+    int ra_stop;
+    int ra_running;
+    pthread_t ra_thread;
+    int stats_pipe[2];
+    int stats_running;
+    pthread_t stats_thread;
+    int trace_on;
+    struct encfs_trace *trace;
+    unsigned long cache_timeout;
+};
+
+/* Default budget for decrypted chunks kept in memory (-o cache_size=MiB) */
+#define P4_CACHE_MB 64
+
+/* Read-ahead starts at P4_RA_MIN_CHUNKS once a handle reads sequentially
+   and doubles on every refill up to -o readahead=KiB */
+#define P4_READAHEAD_KB   1024
+#define P4_RA_MIN_CHUNKS  8
+#define P4_RA_MAX_QUEUED  64
+
+/* Dirty bytes buffered per file before a flush (-o writeback=KiB) */
+#define P4_WRITEBACK_KB   1024
+
+/* Largest write asked of the kernel, and background requests (kernel
+   read-ahead) allowed in flight; the kernel and libfuse may lower both */
+#define P4_MAX_WRITE      (1 << 20)
+#define P4_MAX_BACKGROUND 64
+
+/* Seconds the kernel may trust names, attributes and missing names
+   before asking again (-o cache_timeout=s) */
+#define P4_CACHE_TIMEOUT  1
+
+/* Operations -o trace can queue before its writer must catch up */
+#define P4_TRACE_RECORDS  (1 << 16)
+
+static struct fuse_opt p4_opts[] = {
+	{ "cache_size=%lu", offsetof(struct p4_state, cache_mb), 0 },
+	{ "readahead=%lu", offsetof(struct p4_state, readahead_kb), 0 },
+	{ "writeback=%lu", offsetof(struct p4_state, writeback_kb), 0 },
+	{ "crypt_threads=%lu", offsetof(struct p4_state, crypt_threads), 0 },
+	{ "cipher=%s", offsetof(struct p4_state, cipher_name), 0 },
+	{ "logfile=%s", offsetof(struct p4_state, logfile_name), 0 },
+	{ "trace", offsetof(struct p4_state, trace_on), 1 },
+	{ "cache_timeout=%lu", offsetof(struct p4_state, cache_timeout), 0 },
+	FUSE_OPT_END
 };
 #define P4_DATA ((struct p4_state *) fuse_get_context()->private_data)
 
+#define P4_STATS_PATH "/.encfs-stats"
+
+/* Per-open state kept in fi->fh between open()/create() and release().
+   The read-ahead fields track this handle's access pattern and are
+   protected by ra_lock, since one handle may see concurrent reads.
+   Handles on P4_STATS_PATH have no fd or inode, just the snapshot of
+   the statistics taken at open. */
+struct p4_file {
+	int fd;
+	int encrypted;
+	struct p4_inode *inode;
+	char *stats;
+	size_t stats_len;
+	pthread_mutex_t ra_lock;
+	off_t ra_next;
+	off_t ra_window;
+	off_t ra_until;
+};
+
+/* Background request to decrypt chunks [first, first + count) of inode
+   into the chunk cache. Holds its own inode reference and descriptor so
+   it stays valid if the handle that queued it is released. */
+struct p4_readahead {
+	struct p4_inode *inode;
+	int fd;
+	off_t first;
+	off_t count;
+	struct p4_readahead *next;
+};
+#define P4_FILE(fi) ((struct p4_file *) (uintptr_t) (fi)->fh)
+
+/* Per-opendir state: the open directory stream, the entry the last
+   readdir() could not fit (NULL if none) and the offset it stopped at */
+struct p4_dir {
+	DIR *dp;
+	struct dirent *entry;
+	off_t offset;
+};
+#define P4_DIR(fi) ((struct p4_dir *) (uintptr_t) (fi)->fh)
+
 
 static void prependPath(char fpath[PATH_MAX], const char *path)
 {
@@ -76,17 +256,654 @@ static void prependPath(char fpath[PATH_MAX], const char *path)
 	strncat(fpath, path, PATH_MAX);
 }
 
+/* Write end of the pipe that wakes p4_stats_worker(); the SIGUSR1
+   handler has no other way to reach the mount's state */
+static int p4_stats_wakeup = -1;
+
+static int p4_is_stats(const char *fpath)
+{
+	return strcmp(fpath, P4_STATS_PATH) == 0;
+}
+
+/* Render the operation statistics plus the chunk cache counters into a
+   malloc()ed buffer. Returns NULL if out of memory. */
+static char *p4_stats_snapshot(struct p4_state *state, size_t *len)
+{
+	struct encfs_cache_stats cs;
+	size_t size = 4096;
+	size_t n;
+	char *buf = NULL;
+	char *tmp;
+
+	for (;;) {
+		tmp = realloc(buf, size);
+		if (tmp == NULL) {
+			free(buf);
+			return NULL;
+		}
+		buf = tmp;
+
+		n = encfs_stats_format(buf, size);
+		if (state->cache != NULL) {
+			encfs_cache_get_stats(state->cache, &cs);
+			n += snprintf(n < size ? buf + n : NULL,
+				      n < size ? size - n : 0,
+				      "# cache hits misses evictions\n"
+				      "cache %lu %lu %lu\n",
+				      cs.hits, cs.misses, cs.evictions);
+		}
+		if (n < size)
+			break;
+		size = n + 1;
+	}
+
+	*len = n;
+	return buf;
+}
+
+/* Attributes of P4_STATS_PATH holding a len byte snapshot */
+static void p4_stats_attr(struct stat *stbuf, size_t len)
+{
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_size = len;
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+}
+
+static void p4_stats_signal(int sig)
+{
+	int saved = errno;
+	ssize_t res;
+
+	(void) sig;
+
+	/* A full pipe already has a dump pending */
+	res = write(p4_stats_wakeup, "", 1);
+	(void) res;
+	errno = saved;
+}
+
+/* Append a snapshot to the log for every byte written to stats_pipe,
+   until p4_destroy() closes the write end */
+static void *p4_stats_worker(void *arg)
+{
+	struct p4_state *state = arg;
+	FILE *out = state->logfile != NULL ? state->logfile : stderr;
+	char *buf;
+	size_t len;
+	ssize_t res;
+	char c;
+
+	for (;;) {
+		res = read(state->stats_pipe[0], &c, 1);
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res != 1)
+			break;
+
+		buf = p4_stats_snapshot(state, &len);
+		if (buf == NULL)
+			continue;
+		/* The trace writer may share the stream */
+		flockfile(out);
+		fprintf(out, "# pa4-encfs stats at %ld\n", (long) time(NULL));
+		fwrite(buf, 1, len, out);
+		fflush(out);
+		funlockfile(out);
+		free(buf);
+	}
+
+	return NULL;
+}
+
+/* Look up (or create) the shared inode for the file open on fd and take
+   a reference on it. Returns NULL and sets errno on failure. */
+static struct p4_inode *p4_inode_get(int fd)
+{
+	struct p4_state *state = P4_DATA;
+	struct p4_inode *inode;
+	struct stat st;
+	unsigned int bucket;
+
+	if (fstat(fd, &st) == -1)
+		return NULL;
+
+	bucket = (st.st_ino ^ st.st_dev) % P4_INODE_BUCKETS;
+
+	pthread_mutex_lock(&state->inodes_lock);
+	for (inode = state->inodes[bucket]; inode; inode = inode->next)
+		if (inode->ino == st.st_ino && inode->dev == st.st_dev)
+			break;
+
+	if (inode == NULL) {
+		inode = calloc(1, sizeof(struct p4_inode));
+		if (inode == NULL) {
+			pthread_mutex_unlock(&state->inodes_lock);
+			errno = ENOMEM;
+			return NULL;
+		}
+		inode->dev = st.st_dev;
+		inode->ino = st.st_ino;
+		inode->encrypted = -1;
+		inode->wb_fd = -1;
+		pthread_rwlock_init(&inode->lock, NULL);
+		inode->next = state->inodes[bucket];
+		state->inodes[bucket] = inode;
+	}
+	inode->refs++;
+	pthread_mutex_unlock(&state->inodes_lock);
+
+	return inode;
+}
+
+/* Take another reference on an inode that is already held */
+static void p4_inode_hold(struct p4_state *state, struct p4_inode *inode)
+{
+	pthread_mutex_lock(&state->inodes_lock);
+	inode->refs++;
+	pthread_mutex_unlock(&state->inodes_lock);
+}
+
+/* Drop a reference taken by p4_inode_get(), freeing the last one. Takes
+   state explicitly as it is also called outside FUSE request threads. */
+static void p4_inode_put(struct p4_state *state, struct p4_inode *inode)
+{
+	struct p4_inode **pp;
+	unsigned int bucket = (inode->ino ^ inode->dev) % P4_INODE_BUCKETS;
+
+	pthread_mutex_lock(&state->inodes_lock);
+	if (--inode->refs > 0) {
+		pthread_mutex_unlock(&state->inodes_lock);
+		return;
+	}
+	for (pp = &state->inodes[bucket]; *pp != inode; pp = &(*pp)->next)
+		;
+	*pp = inode->next;
+	pthread_mutex_unlock(&state->inodes_lock);
+
+	/* Once no handle has the file open, nothing keeps its chunks in step
+	   with the backing file, whose inode number may be reused */
+	if (state->cache != NULL)
+		encfs_cache_invalidate(state->cache, inode->dev, inode->ino,
+				       0, -1);
+
+	/* Every handle flushes on release, so nothing dirty is left */
+	pthread_rwlock_destroy(&inode->lock);
+	free(inode->wb_buf);
+	free(inode);
+}
+
+/* Find the shared inode for (dev, ino) if some handle has it open, taking
+   a reference on it; NULL otherwise */
+static struct p4_inode *p4_inode_find(dev_t dev, ino_t ino)
+{
+	struct p4_state *state = P4_DATA;
+	struct p4_inode *inode;
+
+	pthread_mutex_lock(&state->inodes_lock);
+	for (inode = state->inodes[(ino ^ dev) % P4_INODE_BUCKETS]; inode;
+	     inode = inode->next)
+		if (inode->ino == ino && inode->dev == dev) {
+			inode->refs++;
+			break;
+		}
+	pthread_mutex_unlock(&state->inodes_lock);
+
+	return inode;
+}
+
+/* Drop cached plaintext of inode that a change to bytes [start, end] of
+   the file open on fd may affect (end = -1 means through end of file).
+   start is clamped to the current end of file, since writing past it
+   pads the old tail chunk. Must be called before the change is made. */
+static void p4_cache_invalidate(struct p4_inode *inode, int fd, off_t start,
+				off_t end)
+{
+	struct encfs_cache *cache = P4_DATA->cache;
+	struct stat st;
+	off_t plain_size;
+
+	if (cache == NULL)
+		return;
+
+	if (fstat(fd, &st) == -1)
+		start = 0;
+	else {
+		plain_size = encfs_plain_size(st.st_size);
+		if (start > plain_size)
+			start = plain_size;
+	}
+	encfs_cache_invalidate(cache, inode->dev, inode->ino,
+			       start / ENCFS_CHUNK_SIZE,
+			       end < 0 ? -1 : end / ENCFS_CHUNK_SIZE);
+}
+
+/* Drop everything cached for the backing file at path, before it is
+   unlinked or replaced and its inode number becomes reusable */
+static void p4_cache_forget(const char *path)
+{
+	struct encfs_cache *cache = P4_DATA->cache;
+	struct stat st;
+
+	if (cache != NULL && lstat(path, &st) == 0 && S_ISREG(st.st_mode))
+		encfs_cache_invalidate(cache, st.st_dev, st.st_ino, 0, -1);
+}
+
+/* Whether the kernel may keep page data it holds for the file whose
+   stat() result is st, and remember this open for the next one. Only an
+   inode whose ctime has not moved since it was last opened, or last
+   changed through the mount (p4_keep_cache_note()), keeps its pages;
+   changes made directly to the backing file and user.encrypted changes
+   (which also clear the slot) do not. The slot is taken over from
+   whatever inode held it, so a file opened again soon keeps its pages
+   even after an eviction. */
+static int p4_keep_cache(const struct stat *st)
+{
+	struct p4_state *state = P4_DATA;
+	struct p4_attr_slot *slot;
+	int keep = 0;
+
+	slot = &state->attrs[(st->st_ino ^ st->st_dev) % P4_ATTR_SLOTS];
+
+	pthread_mutex_lock(&state->attrs_lock);
+	if (slot->ino == st->st_ino && slot->dev == st->st_dev) {
+		keep = slot->open_ctime.tv_sec == st->st_ctim.tv_sec &&
+			slot->open_ctime.tv_nsec == st->st_ctim.tv_nsec;
+	} else {
+		memset(slot, 0, sizeof(*slot));
+		slot->dev = st->st_dev;
+		slot->ino = st->st_ino;
+		slot->encrypted = -1;
+		slot->chunked = -1;
+	}
+	slot->open_ctime = st->st_ctim;
+	pthread_mutex_unlock(&state->attrs_lock);
+
+	return keep;
+}
+
+/* Record the ctime of the file open on fd after a write or truncate made
+   through the mount, which the kernel's page data already reflects, so
+   the change does not cost the next open its pages */
+static void p4_keep_cache_note(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == 0)
+		p4_keep_cache(&st);
+}
+
+/* Write the inode's dirty extent to disk and mark it clean. Returns the
+   first error since the last call, including earlier failed flushes.
+   Caller holds the inode lock exclusive. */
+static int p4_wb_flush(struct p4_inode *inode)
+{
+	ssize_t written;
+	int res;
+
+	if (inode->wb_fd != -1) {
+		p4_cache_invalidate(inode, inode->wb_fd, inode->wb_off,
+				    inode->wb_off + inode->wb_len - 1);
+		written = encfs_pwrite(inode->wb_fd, inode->wb_buf,
+				       inode->wb_len, inode->wb_off,
+				       &inode->key);
+		if (written < 0 && inode->wb_err == 0)
+			inode->wb_err = written;
+		else if (written >= 0)
+			p4_keep_cache_note(inode->wb_fd);
+		close(inode->wb_fd);
+		inode->wb_fd = -1;
+		inode->wb_len = 0;
+	}
+
+	res = inode->wb_err;
+	inode->wb_err = 0;
+	return res;
+}
+
+/* Throw the inode's dirty extent away unwritten, along with any error
+   from flushing it, when the file is about to be emptied. Caller holds
+   the inode lock exclusive. */
+static void p4_wb_discard(struct p4_inode *inode)
+{
+	if (inode->wb_fd != -1) {
+		close(inode->wb_fd);
+		inode->wb_fd = -1;
+		inode->wb_len = 0;
+	}
+	inode->wb_err = 0;
+}
+
+/* Add [offset, offset + size) to the inode's dirty extent if it overlaps
+   or abuts it and the result fits in cap bytes, or start a new extent if
+   the inode is clean. Returns 0 if the caller has to write it itself.
+   Caller holds the inode lock exclusive. */
+static int p4_wb_add(struct p4_inode *inode, int fd, const char *buf,
+		     size_t size, off_t offset, size_t cap)
+{
+	off_t start;
+	off_t end;
+
+	if (size >= cap)
+		return 0;
+
+	if (inode->wb_fd == -1) {
+		if (inode->wb_buf == NULL) {
+			inode->wb_buf = malloc(cap);
+			if (inode->wb_buf == NULL)
+				return 0;
+		}
+		inode->wb_fd = dup(fd);
+		if (inode->wb_fd == -1)
+			return 0;
+		inode->wb_off = offset;
+		inode->wb_len = 0;
+	}
+
+	start = offset < inode->wb_off ? offset : inode->wb_off;
+	end = inode->wb_off + inode->wb_len;
+	if (offset + (off_t) size > end)
+		end = offset + size;
+	if (offset > inode->wb_off + (off_t) inode->wb_len ||
+	    offset + (off_t) size < inode->wb_off || end - start > (off_t) cap)
+		return 0;
+
+	if (start < inode->wb_off)
+		memmove(inode->wb_buf + (inode->wb_off - start), inode->wb_buf,
+			inode->wb_len);
+	memcpy(inode->wb_buf + (offset - start), buf, size);
+	inode->wb_off = start;
+	inode->wb_len = end - start;
+	return 1;
+}
+
+/* Lay the inode's dirty extent over res bytes read from disk at offset
+   into buf. Anything between the end of the file on disk and the end of
+   the extent reads as zeros. Returns the resulting byte count. Caller
+   holds the inode lock at least shared. */
+static int p4_wb_overlay(struct p4_inode *inode, char *buf, size_t size,
+			 off_t offset, int res)
+{
+	off_t start = inode->wb_off;
+	off_t end = inode->wb_off + inode->wb_len;
+
+	if (inode->wb_fd == -1 || res < 0)
+		return res;
+
+	if (start < offset)
+		start = offset;
+	if (end > offset + (off_t) size)
+		end = offset + size;
+
+	if (end - offset > res) {
+		memset(buf + res, 0, end - offset - res);
+		res = end - offset;
+	}
+	if (start < end)
+		memcpy(buf + (start - offset),
+		       inode->wb_buf + (start - inode->wb_off), end - start);
+
+	return res;
+}
+
+/* Plaintext size of the inode's file, given its size on disk */
+static off_t p4_wb_size(struct p4_inode *inode, off_t plain_size)
+{
+	if (inode->wb_fd != -1 &&
+	    inode->wb_off + (off_t) inode->wb_len > plain_size)
+		return inode->wb_off + inode->wb_len;
+	return plain_size;
+}
+
+/* Work out which cipher the encrypted file open on fd uses, the first time
+   the inode is seen. Files left behind by the whole-file CBC format are
+   converted here, once, so read() and write() only ever see chunked
+   files; they and empty files take the mount's cipher. A read-only fd
+   converts through a writable descriptor of path's own, and the open
+   fails if the backing file cannot be written. Caller holds the inode
+   lock exclusive. */
+static int p4_inode_format(struct p4_inode *inode, int fd, const char *path)
+{
+	struct p4_state *state = P4_DATA;
+	int mode = state->new_mode;
+	int wfd = fd;
+	int res;
+
+	if (inode->key.ac != NULL)
+		return 0;
+
+	res = encfs_probe(fd, &mode, &inode->key);
+	if (res < 0)
+		return res;
+	/* A mode that failed to set up at mount time cannot read it */
+	if (state->ciphers[mode].ctx == NULL)
+		return -EIO;
+	inode->key.ac = &state->ciphers[mode];
+	if (res == ENCFS_FMT_LEGACY) {
+		if ((fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY) {
+			wfd = open(path, O_RDWR);
+			if (wfd == -1)
+				res = -errno;
+		}
+		if (wfd != -1) {
+			p4_cache_invalidate(inode, wfd, 0, -1);
+			res = encfs_upgrade(wfd, &inode->key);
+			if (wfd != fd)
+				close(wfd);
+		}
+	}
+	if (res < 0) {
+		inode->key.ac = NULL;
+		return res;
+	}
+	return 0;
+}
+
+/* Whether the backing file at path is flagged as encrypted */
+static int p4_is_encrypted(const char *path)
+{
+	char xattr_value[8];
+	ssize_t xattr_len;
+
+	xattr_len = getxattr(path, XATTR_FLAGS, xattr_value, 8);
+	return xattr_len != -1 && !memcmp(xattr_value, XATTR_ENCRYPTED, 4);
+}
+
+/* The cached user.encrypted decision of the open inode (dev, ino), or -1
+   if it is not open or not known */
+static int p4_inode_encrypted(dev_t dev, ino_t ino)
+{
+	struct p4_state *state = P4_DATA;
+	struct p4_inode *inode;
+	int encrypted = -1;
+
+	pthread_mutex_lock(&state->inodes_lock);
+	for (inode = state->inodes[(ino ^ dev) % P4_INODE_BUCKETS]; inode;
+	     inode = inode->next)
+		if (inode->ino == ino && inode->dev == dev) {
+			encrypted = inode->encrypted;
+			break;
+		}
+	pthread_mutex_unlock(&state->inodes_lock);
+
+	return encrypted;
+}
+
+/* Set the cached decision of an inode we hold a reference on */
+static void p4_inode_set_encrypted(struct p4_inode *inode, int encrypted)
+{
+	struct p4_state *state = P4_DATA;
+
+	pthread_mutex_lock(&state->inodes_lock);
+	inode->encrypted = encrypted;
+	pthread_mutex_unlock(&state->inodes_lock);
+}
+
+/* p4_is_encrypted() for a file whose (l)stat() result is st. An open inode
+   answers for itself; otherwise the attribute cache answers when the
+   inode has not changed since. Writes move ctime, so the open inode is
+   what spares getattr() a getxattr() after every write to a file. */
+static int p4_is_encrypted_stat(const char *path, const struct stat *st)
+{
+	struct p4_state *state = P4_DATA;
+	struct p4_attr_slot *slot;
+	int encrypted;
+
+	if (!S_ISREG(st->st_mode))
+		return 0;
+
+	encrypted = p4_inode_encrypted(st->st_dev, st->st_ino);
+	if (encrypted >= 0)
+		return encrypted;
+
+	slot = &state->attrs[(st->st_ino ^ st->st_dev) % P4_ATTR_SLOTS];
+
+	pthread_mutex_lock(&state->attrs_lock);
+	if (slot->ino == st->st_ino && slot->dev == st->st_dev &&
+	    slot->ctime.tv_sec == st->st_ctim.tv_sec &&
+	    slot->ctime.tv_nsec == st->st_ctim.tv_nsec)
+		encrypted = slot->encrypted;
+	pthread_mutex_unlock(&state->attrs_lock);
+
+	if (encrypted >= 0)
+		return encrypted;
+
+	encrypted = p4_is_encrypted(path);
+
+	pthread_mutex_lock(&state->attrs_lock);
+	if (slot->ino != st->st_ino || slot->dev != st->st_dev)
+		memset(&slot->open_ctime, 0, sizeof(slot->open_ctime));
+	slot->dev = st->st_dev;
+	slot->ino = st->st_ino;
+	slot->ctime = st->st_ctim;
+	slot->encrypted = encrypted;
+	slot->chunked = -1;
+	pthread_mutex_unlock(&state->attrs_lock);
+
+	return encrypted;
+}
+
+/* Whether the encrypted file at path, whose lstat() result is st, starts
+   with the chunked format's magic. Legacy whole-file CBC files keep
+   their ciphertext size until p4_inode_format() converts them on open.
+   The answer is cached next to p4_is_encrypted_stat()'s; a file that
+   cannot be read is taken to be chunked. */
+static int p4_is_chunked_stat(const char *path, const struct stat *st)
+{
+	struct p4_state *state = P4_DATA;
+	struct p4_attr_slot *slot;
+	char magic[sizeof(ENCFS_MAGIC)];
+	int chunked = -1;
+	int fd;
+
+	slot = &state->attrs[(st->st_ino ^ st->st_dev) % P4_ATTR_SLOTS];
+
+	pthread_mutex_lock(&state->attrs_lock);
+	if (slot->ino == st->st_ino && slot->dev == st->st_dev &&
+	    slot->ctime.tv_sec == st->st_ctim.tv_sec &&
+	    slot->ctime.tv_nsec == st->st_ctim.tv_nsec)
+		chunked = slot->chunked;
+	pthread_mutex_unlock(&state->attrs_lock);
+
+	if (chunked >= 0)
+		return chunked;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 1;
+	chunked = pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+		!memcmp(magic, ENCFS_MAGIC, sizeof(magic));
+	close(fd);
+
+	pthread_mutex_lock(&state->attrs_lock);
+	if (slot->ino == st->st_ino && slot->dev == st->st_dev &&
+	    slot->ctime.tv_sec == st->st_ctim.tv_sec &&
+	    slot->ctime.tv_nsec == st->st_ctim.tv_nsec)
+		slot->chunked = chunked;
+	pthread_mutex_unlock(&state->attrs_lock);
+
+	return chunked;
+}
+
+/* Forget the cached user.encrypted decisions for the file at path.
+   Handles already open keep the decision they were opened with. The
+   file now reads differently through the mount, so the next open drops
+   the kernel's page data as well (p4_keep_cache()). */
+static void p4_attr_forget(const char *path)
+{
+	struct p4_state *state = P4_DATA;
+	struct p4_attr_slot *slot;
+	struct p4_inode *inode;
+	struct stat st;
+
+	if (lstat(path, &st) == -1)
+		return;
+
+	slot = &state->attrs[(st.st_ino ^ st.st_dev) % P4_ATTR_SLOTS];
+
+	pthread_mutex_lock(&state->attrs_lock);
+	if (slot->ino == st.st_ino && slot->dev == st.st_dev)
+		memset(slot, 0, sizeof(*slot));
+	pthread_mutex_unlock(&state->attrs_lock);
+
+	inode = p4_inode_find(st.st_dev, st.st_ino);
+	if (inode != NULL) {
+		p4_inode_set_encrypted(inode, -1);
+		p4_inode_put(state, inode);
+	}
+}
+
 static int p4_getattr(const char *fpath, struct stat *stbuf)
 {
 	char path[PATH_MAX];
 	prependPath(path,fpath);
+	struct p4_inode *inode;
+	char *snap;
+	size_t len;
+	int chunked;
 	int res;
 
+	if (p4_is_stats(fpath)) {
+		snap = p4_stats_snapshot(P4_DATA, &len);
+		if (snap == NULL)
+			return -ENOMEM;
+		free(snap);
+		p4_stats_attr(stbuf, len);
+		return 0;
+	}
 
 	res = lstat(path, stbuf);
 	if (res == -1)
 		return -errno;
 
+	/* The plaintext size follows from the chunk layout, so no
+	   decryption is needed to report it. An open inode has been
+	   converted to the chunked format already; any other file is
+	   checked for it, since a legacy CBC file has no such layout and
+	   keeps its backing size until it is first opened. */
+	if (S_ISREG(stbuf->st_mode) && stbuf->st_size > 0 &&
+	    p4_is_encrypted_stat(path, stbuf)) {
+		chunked = 0;
+
+		/* Count writes still sitting in an open handle's buffer */
+		inode = p4_inode_find(stbuf->st_dev, stbuf->st_ino);
+		if (inode != NULL) {
+			pthread_rwlock_rdlock(&inode->lock);
+			if (inode->key.ac != NULL) {
+				stbuf->st_size = p4_wb_size(inode,
+					encfs_plain_size(stbuf->st_size));
+				chunked = 1;
+			}
+			pthread_rwlock_unlock(&inode->lock);
+			p4_inode_put(P4_DATA, inode);
+		}
+		if (!chunked && p4_is_chunked_stat(path, stbuf))
+			stbuf->st_size = encfs_plain_size(stbuf->st_size);
+	}
+
 	return 0;
 }
 
@@ -96,6 +913,9 @@ static int p4_access(const char *fpath, int mask)
 	prependPath(path,fpath);
 	int res;
 
+	if (p4_is_stats(fpath))
+		return (mask & (W_OK | X_OK)) ? -EACCES : 0;
+
 	res = access(path, mask);
 	if (res == -1)
 		return -errno;
@@ -118,32 +938,82 @@ static int p4_readlink(const char *fpath, char *buf, size_t size)
 }
 
 
-static int p4_readdir(const char *fpath, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
+static int p4_opendir(const char *fpath, struct fuse_file_info *fi)
 {
 	char path[PATH_MAX];
 	prependPath(path,fpath);
+	struct p4_dir *d;
 
-	DIR *dp;
-	struct dirent *de;
-
-	(void) offset;
-	(void) fi;
+	d = malloc(sizeof(*d));
+	if (d == NULL)
+		return -ENOMEM;
 
-	dp = opendir(path);
-	if (dp == NULL)
+	d->dp = opendir(path);
+	if (d->dp == NULL) {
+		free(d);
 		return -errno;
+	}
+	d->entry = NULL;
+	d->offset = 0;
+
+	fi->fh = (uintptr_t) d;
+	return 0;
+}
+
+/* Hands out entries from where the last call stopped, passing each
+   entry's telldir() cookie as its offset, so a directory too big for
+   one reply is listed in one pass instead of being re-read from the
+   start for every buffer the kernel asks for. */
+static int p4_readdir(const char *fpath, void *buf, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	struct p4_dir *d = P4_DIR(fi);
+	struct stat st;
+	off_t next;
+
+	(void) fpath;
+
+	/* A rewind or seek from the caller; otherwise carry on, including
+	   with the entry that did not fit last time */
+	if (offset != d->offset) {
+		if (offset == 0)
+			rewinddir(d->dp);
+		else
+			seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
+
+	for (;;) {
+		if (d->entry == NULL) {
+			errno = 0;
+			d->entry = readdir(d->dp);
+			if (d->entry == NULL)
+				return -errno;
+		}
 
-	while ((de = readdir(dp)) != NULL) {
-		struct stat st;
 		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
+		st.st_ino = d->entry->d_ino;
+		st.st_mode = d->entry->d_type << 12;
+		next = telldir(d->dp);
+		if (filler(buf, d->entry->d_name, &st, next))
 			break;
+
+		d->entry = NULL;
+		d->offset = next;
 	}
 
-	closedir(dp);
+	return 0;
+}
+
+static int p4_releasedir(const char *fpath, struct fuse_file_info *fi)
+{
+	struct p4_dir *d = P4_DIR(fi);
+
+	(void) fpath;
+
+	closedir(d->dp);
+	free(d);
 	return 0;
 }
 
@@ -188,6 +1058,10 @@ static int p4_unlink(const char *fpath)
 	prependPath(path,fpath);
 	int res;
 
+	if (p4_is_stats(fpath))
+		return -EPERM;
+
+	p4_cache_forget(path);
 	res = unlink(path);
 	if (res == -1)
 		return -errno;
@@ -210,9 +1084,11 @@ static int p4_rmdir(const char *fpath)
 
 static int p4_symlink(const char *from, const char *to)
 {
+	char path[PATH_MAX];
+	prependPath(path,to);
 	int res;
 
-	res = symlink(from, to);
+	res = symlink(from, path);
 	if (res == -1)
 		return -errno;
 
@@ -221,9 +1097,18 @@ static int p4_symlink(const char *from, const char *to)
 
 static int p4_rename(const char *from, const char *to)
 {
+	char fpath[PATH_MAX];
+	char tpath[PATH_MAX];
+	prependPath(fpath,from);
+	prependPath(tpath,to);
 	int res;
 
-	res = rename(from, to);
+	if (p4_is_stats(from) || p4_is_stats(to))
+		return -EPERM;
+
+	/* Whatever to named is about to lose a link */
+	p4_cache_forget(tpath);
+	res = rename(fpath, tpath);
 	if (res == -1)
 		return -errno;
 
@@ -232,9 +1117,13 @@ static int p4_rename(const char *from, const char *to)
 
 static int p4_link(const char *from, const char *to)
 {
+	char fpath[PATH_MAX];
+	char tpath[PATH_MAX];
+	prependPath(fpath,from);
+	prependPath(tpath,to);
 	int res;
 
-	res = link(from, to);
+	res = link(fpath, tpath);
 	if (res == -1)
 		return -errno;
 
@@ -247,6 +1136,9 @@ static int p4_chmod(const char *fpath, mode_t mode)
 	prependPath(path,fpath);
 	int res;
 
+	if (p4_is_stats(fpath))
+		return -EPERM;
+
 	res = chmod(path, mode);
 	if (res == -1)
 		return -errno;
@@ -260,6 +1152,9 @@ static int p4_chown(const char *fpath, uid_t uid, gid_t gid)
 	prependPath(path,fpath);
 	int res;
 
+	if (p4_is_stats(fpath))
+		return -EPERM;
+
 	res = lchown(path, uid, gid);
 	if (res == -1)
 		return -errno;
@@ -271,13 +1166,53 @@ static int p4_truncate(const char *fpath, off_t size)
 {
 	char path[PATH_MAX];
 	prependPath(path,fpath);
+	struct p4_inode *inode;
+	struct stat st;
+	int fd;
 	int res;
 
-	res = truncate(path, size);
-	if (res == -1)
+	if (p4_is_stats(fpath))
+		return -EPERM;
+
+	if (stat(path, &st) == -1)
 		return -errno;
 
-	return 0;
+	if (!p4_is_encrypted_stat(path, &st)) {
+		res = truncate(path, size);
+		if (res == -1)
+			return -errno;
+		if (stat(path, &st) == 0)
+			p4_keep_cache(&st);
+
+		return 0;
+	}
+
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		return -errno;
+
+	inode = p4_inode_get(fd);
+	if (inode == NULL) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+
+	pthread_rwlock_wrlock(&inode->lock);
+	res = p4_inode_format(inode, fd, path);
+	if (res == 0)
+		res = p4_wb_flush(inode);
+	if (res == 0) {
+		p4_cache_invalidate(inode, fd, size, -1);
+		res = encfs_truncate(fd, size, &inode->key);
+		if (res == 0)
+			p4_keep_cache_note(fd);
+	}
+	pthread_rwlock_unlock(&inode->lock);
+
+	p4_inode_put(P4_DATA, inode);
+	close(fd);
+	return res;
 }
 
 static int p4_utimens(const char *fpath, const struct timespec ts[2])
@@ -285,6 +1220,9 @@ static int p4_utimens(const char *fpath, const struct timespec ts[2])
 	char path[PATH_MAX];
 	prependPath(path,fpath);
 	int res;
+
+	if (p4_is_stats(fpath))
+		return -EPERM;
 	struct timeval tv[2];
 
 	tv[0].tv_sec = ts[0].tv_sec;
@@ -299,130 +1237,545 @@ static int p4_utimens(const char *fpath, const struct timespec ts[2])
 	return 0;
 }
 
+/* Wrap an open backing descriptor in a struct p4_file stored in fi->fh */
+static int p4_attach(struct fuse_file_info *fi, int fd, int encrypted)
+{
+	struct p4_file *fh;
+
+	fh = malloc(sizeof(struct p4_file));
+	if (fh == NULL)
+		return -ENOMEM;
+
+	fh->inode = p4_inode_get(fd);
+	if (fh->inode == NULL) {
+		free(fh);
+		return -errno;
+	}
+
+	fh->fd = fd;
+	fh->encrypted = encrypted;
+	fh->stats = NULL;
+	fh->stats_len = 0;
+	pthread_mutex_init(&fh->ra_lock, NULL);
+	fh->ra_next = 0;
+	fh->ra_window = 0;
+	fh->ra_until = 0;
+	fi->fh = (uintptr_t) fh;
+	return 0;
+}
+
+/* Undo p4_attach() or p4_stats_open(), closing the backing descriptor */
+static void p4_detach(struct fuse_file_info *fi)
+{
+	struct p4_file *fh = P4_FILE(fi);
+
+	if (fh->inode != NULL)
+		p4_inode_put(P4_DATA, fh->inode);
+	pthread_mutex_destroy(&fh->ra_lock);
+	if (fh->fd != -1)
+		close(fh->fd);
+	free(fh->stats);
+	free(fh);
+	fi->fh = 0;
+}
+
+/* Open P4_STATS_PATH: the handle reads a snapshot taken now */
+static int p4_stats_open(struct fuse_file_info *fi)
+{
+	struct p4_file *fh;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	fh = calloc(1, sizeof(struct p4_file));
+	if (fh == NULL)
+		return -ENOMEM;
+
+	fh->stats = p4_stats_snapshot(P4_DATA, &fh->stats_len);
+	if (fh->stats == NULL) {
+		free(fh);
+		return -ENOMEM;
+	}
+	fh->fd = -1;
+	pthread_mutex_init(&fh->ra_lock, NULL);
+	fi->fh = (uintptr_t) fh;
+
+	/* The size getattr() reported is already stale, so keep the
+	   kernel from trimming reads to it or caching the contents */
+	fi->direct_io = 1;
+	return 0;
+}
+
 static int p4_open(const char *fpath, struct fuse_file_info *fi)
 {
 	char path[PATH_MAX];
 	prependPath(path,fpath);
+	struct p4_file *fh;
+	struct stat st;
+	int flags = fi->flags;
+	int encrypted;
+	int fd;
 	int res;
 
-	res = open(path, fi->flags);
-	if (res == -1)
+	if (p4_is_stats(fpath))
+		return p4_stats_open(fi);
+
+	/* Another handle on the file, or a recent getattr(), usually
+	   knows the answer already */
+	if (stat(path, &st) == -1)
+		return -errno;
+	encrypted = p4_is_encrypted_stat(path, &st);
+
+	/* Encrypted writes read-modify-write whole chunks at explicit
+	   offsets, so a writer's backing file must be readable and not
+	   O_APPEND; readers keep O_RDONLY, so files they cannot write stay
+	   readable. O_TRUNC (only passed with atomic_o_trunc) is applied
+	   below, once the inode's cached chunks can be dropped with it. */
+	if (encrypted) {
+		flags &= ~(O_APPEND | O_TRUNC);
+		if ((flags & O_ACCMODE) == O_WRONLY)
+			flags = (flags & ~O_ACCMODE) | O_RDWR;
+	}
+
+	fd = open(path, flags);
+	if (fd == -1)
 		return -errno;
 
-	close(res);
+	res = p4_attach(fi, fd, encrypted);
+	if (res < 0) {
+		close(fd);
+		return res;
+	}
+	fh = P4_FILE(fi);
+	p4_inode_set_encrypted(fh->inode, encrypted);
+	fi->keep_cache = p4_keep_cache(&st);
+
+	if (encrypted) {
+		pthread_rwlock_wrlock(&fh->inode->lock);
+		res = 0;
+		if (fi->flags & O_TRUNC) {
+			p4_wb_discard(fh->inode);
+			p4_cache_invalidate(fh->inode, fd, 0, -1);
+			if (ftruncate(fd, 0) == -1)
+				res = -errno;
+		}
+		if (res == 0)
+			res = p4_inode_format(fh->inode, fd, path);
+		pthread_rwlock_unlock(&fh->inode->lock);
+		if (res < 0) {
+			p4_detach(fi);
+			return res;
+		}
+	}
+
 	return 0;
 }
 
-static int p4_read(const char *fpath, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+/* Read plaintext of an encrypted file through the shared chunk cache.
+   Misses decrypt whole chunks through to the end of the request (so the
+   cache only ever holds complete chunks) and insert every one of them.
+   Caller holds the inode lock at least shared. */
+static int p4_read_chunks(struct p4_file *fh, char *buf, size_t size,
+			  off_t offset)
 {
-	char path[PATH_MAX];
-	prependPath(path,fpath);
+	struct p4_state *state = P4_DATA;
+	struct p4_inode *inode = fh->inode;
+	unsigned char *plain;
+	size_t done = 0;
+	size_t skip;
+	size_t got;
+	size_t len;
+	size_t n;
+	ssize_t res;
+	off_t pos;
+	off_t idx;
+	off_t run;
+	off_t i;
+
+	if (state->cache == NULL || size == 0)
+		return encfs_pread(fh->fd, buf, size, offset, &inode->key);
+
+	while (done < size) {
+		pos = offset + done;
+		idx = pos / ENCFS_CHUNK_SIZE;
+		skip = pos % ENCFS_CHUNK_SIZE;
+
+		res = encfs_cache_get(state->cache, inode->dev, inode->ino,
+				      inode->key.id, idx, skip, size - done,
+				      buf + done);
+		if (res >= 0) {
+			done += res;
+			/* A short cached chunk is the end of the file */
+			if (skip + res < ENCFS_CHUNK_SIZE)
+				break;
+			continue;
+		}
+
+		run = (offset + size - 1) / ENCFS_CHUNK_SIZE - idx + 1;
+		if (run > ENCFS_BATCH_CHUNKS)
+			run = ENCFS_BATCH_CHUNKS;
+
+		plain = malloc(run * ENCFS_CHUNK_SIZE);
+		if (plain == NULL)
+			return -ENOMEM;
+
+		res = encfs_pread(fh->fd, (char *) plain, run * ENCFS_CHUNK_SIZE,
+				  idx * ENCFS_CHUNK_SIZE, &inode->key);
+		if (res < 0) {
+			free(plain);
+			return res;
+		}
+		got = res;
+
+		for (i = 0; (size_t) i * ENCFS_CHUNK_SIZE < got; i++) {
+			len = got - i * ENCFS_CHUNK_SIZE;
+			if (len > ENCFS_CHUNK_SIZE)
+				len = ENCFS_CHUNK_SIZE;
+			encfs_cache_put(state->cache, inode->dev, inode->ino,
+					inode->key.id, idx + i,
+					plain + i * ENCFS_CHUNK_SIZE, len);
+		}
+
+		n = got > skip ? got - skip : 0;
+		if (n > size - done)
+			n = size - done;
+		memcpy(buf + done, plain + skip, n);
+		done += n;
+		free(plain);
+
+		if (got < (size_t) run * ENCFS_CHUNK_SIZE)
+			break;
+	}
 
-	//int fd;
-	int res;
+	return done;
+}
 
-	(void) fi;
-	(void) offset;
+/* Decrypt the chunks a read-ahead request asks for into the cache,
+   skipping any that are already there */
+static void p4_readahead_run(struct p4_state *state, struct p4_readahead *ra)
+{
+	struct p4_inode *inode = ra->inode;
+	unsigned char *plain;
+	ssize_t got;
+	size_t len;
+	off_t i;
+
+	pthread_rwlock_rdlock(&inode->lock);
+
+	while (ra->count > 0 &&
+	       encfs_cache_has(state->cache, inode->dev, inode->ino,
+				   inode->key.id, ra->first)) {
+		ra->first++;
+		ra->count--;
+	}
+	if (ra->count == 0)
+		goto out;
+
+	plain = malloc(ra->count * ENCFS_CHUNK_SIZE);
+	if (plain == NULL)
+		goto out;
+
+	got = encfs_pread(ra->fd, (char *) plain, ra->count * ENCFS_CHUNK_SIZE,
+			  ra->first * ENCFS_CHUNK_SIZE, &inode->key);
+	for (i = 0; got > 0 && i * ENCFS_CHUNK_SIZE < got; i++) {
+		len = got - i * ENCFS_CHUNK_SIZE;
+		if (len > ENCFS_CHUNK_SIZE)
+			len = ENCFS_CHUNK_SIZE;
+		encfs_cache_put(state->cache, inode->dev, inode->ino,
+				inode->key.id, ra->first + i,
+				plain + i * ENCFS_CHUNK_SIZE, len);
+	}
+	free(plain);
 
-	char *mtext;
-	size_t msize;
-	int action = PASSTHROUGH;
-	char xattr_value[8];
-	ssize_t xattr_len;
+out:
+	pthread_rwlock_unlock(&inode->lock);
+}
 
-	FILE *inFile, *outFile;
+static void *p4_readahead_worker(void *arg)
+{
+	struct p4_state *state = arg;
+	struct p4_readahead *ra;
+
+	for (;;) {
+		pthread_mutex_lock(&state->ra_lock);
+		while (state->ra_head == NULL && !state->ra_stop)
+			pthread_cond_wait(&state->ra_cond, &state->ra_lock);
+		if (state->ra_stop) {
+			pthread_mutex_unlock(&state->ra_lock);
+			break;
+		}
+		ra = state->ra_head;
+		state->ra_head = ra->next;
+		if (state->ra_head == NULL)
+			state->ra_tail = &state->ra_head;
+		state->ra_queued--;
+		pthread_mutex_unlock(&state->ra_lock);
+
+		p4_readahead_run(state, ra);
+
+		p4_inode_put(state, ra->inode);
+		close(ra->fd);
+		free(ra);
+	}
 
-	inFile = fopen(path, "r");
-	if (inFile == NULL)
-		return -errno;
-	// open file from memory - The Heap
-	outFile = open_memstream(&mtext, &msize);
-	if (outFile == NULL)
-		return -errno;
+	return NULL;
+}
 
-	xattr_len = getxattr(path, XATTR_FLAGS, xattr_value, 8);
-	if (xattr_len != -1 && !memcmp(xattr_value, XATTR_ENCRYPTED, 4))
-		action = DECRYPT;
+/* Queue decryption of chunks [first, first + count) of fh's file. Best
+   effort: requests are dropped if the worker is backed up. */
+static void p4_readahead_queue(struct p4_state *state, struct p4_file *fh,
+			       off_t first, off_t count)
+{
+	struct p4_readahead *ra;
 
-	do_crypt(inFile, outFile, action, P4_DATA->key_phrase);
-	fclose(inFile);
+	ra = malloc(sizeof(struct p4_readahead));
+	if (ra == NULL)
+		return;
 
-	fflush(outFile);
-	fseek(outFile, offset, SEEK_SET);
-	res = fread(buf, 1, size, outFile);
+	ra->fd = dup(fh->fd);
+	if (ra->fd == -1) {
+		free(ra);
+		return;
+	}
+	ra->inode = fh->inode;
+	ra->first = first;
+	ra->count = count;
+	ra->next = NULL;
+
+	pthread_mutex_lock(&state->ra_lock);
+	if (state->ra_queued >= P4_RA_MAX_QUEUED || state->ra_stop) {
+		pthread_mutex_unlock(&state->ra_lock);
+		close(ra->fd);
+		free(ra);
+		return;
+	}
+	p4_inode_hold(state, fh->inode);
+	*state->ra_tail = ra;
+	state->ra_tail = &ra->next;
+	state->ra_queued++;
+	pthread_cond_signal(&state->ra_cond);
+	pthread_mutex_unlock(&state->ra_lock);
+}
 
-	/*fd = open(path, O_RDONLY);
-	if (fd == -1)
-		return -errno;
+/* Track fh's access pattern and, while it keeps reading sequentially,
+   keep a growing window of chunks past the read decrypted ahead of it */
+static void p4_readahead(struct p4_file *fh, off_t offset, size_t size)
+{
+	struct p4_state *state = P4_DATA;
+	off_t max = (state->readahead_kb << 10) / ENCFS_CHUNK_SIZE;
+	off_t end = (offset + size + ENCFS_CHUNK_SIZE - 1) / ENCFS_CHUNK_SIZE;
+	off_t first = -1;
+	off_t count = 0;
+
+	if (!state->ra_running || max == 0)
+		return;
+
+	pthread_mutex_lock(&fh->ra_lock);
+	if (offset != fh->ra_next) {
+		/* Random access: stop prefetching until it looks sequential */
+		fh->ra_window = 0;
+		fh->ra_until = 0;
+	} else if (fh->ra_until - end < fh->ra_window / 2) {
+		/* Refill once less than half a window is left ahead */
+		fh->ra_window = fh->ra_window ? fh->ra_window * 2 : P4_RA_MIN_CHUNKS;
+		if (fh->ra_window > max)
+			fh->ra_window = max;
+		first = fh->ra_until > end ? fh->ra_until : end;
+		count = end + fh->ra_window - first;
+		fh->ra_until = first + count;
+	}
+	fh->ra_next = offset + size;
+	pthread_mutex_unlock(&fh->ra_lock);
+
+	if (count > 0)
+		p4_readahead_queue(state, fh, first, count);
+}
+
+static int p4_read(const char *fpath, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	struct p4_file *fh = P4_FILE(fi);
+	int res;
+
+	(void) fpath;
+
+	if (fh->stats != NULL) {
+		if (offset >= (off_t) fh->stats_len)
+			return 0;
+		if (size > fh->stats_len - offset)
+			size = fh->stats_len - offset;
+		memcpy(buf, fh->stats + offset, size);
+		return size;
+	}
+
+	/* Only the chunks covering [offset, offset + size) are decrypted */
+	if (fh->encrypted) {
+		p4_readahead(fh, offset, size);
+
+		pthread_rwlock_rdlock(&fh->inode->lock);
+		if (fh->inode->wb_fd != -1 && offset >= fh->inode->wb_off &&
+		    offset + (off_t) size <= fh->inode->wb_off +
+		    (off_t) fh->inode->wb_len) {
+			/* Entirely within unflushed writes */
+			memcpy(buf, fh->inode->wb_buf + (offset - fh->inode->wb_off),
+			       size);
+			res = size;
+		} else {
+			res = p4_read_chunks(fh, buf, size, offset);
+			res = p4_wb_overlay(fh->inode, buf, size, offset, res);
+		}
+		pthread_rwlock_unlock(&fh->inode->lock);
+		return res;
+	}
 
-	res = pread(fd, buf, size, offset);*/
+	res = pread(fh->fd, buf, size, offset);
 	if (res == -1)
 		res = -errno;
 
-	//close(fd);
-	fclose(outFile);
 	return res;
 }
 
 static int p4_write(const char *fpath, const char *buf, size_t size,
 		     off_t offset, struct fuse_file_info *fi)
 {
-	char path[PATH_MAX];
-	prependPath(path,fpath);
-
-	//int fd;
+	struct p4_file *fh = P4_FILE(fi);
 	int res;
 
-	(void) fi;
-
-	char *mtext;
-	size_t msize;
-	int action = PASSTHROUGH;
-	char xattr_value[8];
-	ssize_t xattr_len;
+	(void) fpath;
 
-	FILE * inFile, * outFile;
-	
-	inFile = fopen(path, "r");
-	if (inFile == NULL)
-		return -errno;
-	// open file from memory - The Heap
-	outFile = open_memstream(&mtext, &msize);
-	if (outFile == NULL)
-		return -errno;
+	/* Partially covered chunks are read-modify-written, so writers
+	   must exclude each other and any reader of the same file. Small
+	   writes are coalesced in the inode's write-back buffer and only
+	   encrypted once it fills or the file is flushed. */
+	if (fh->encrypted) {
+		size_t cap = P4_DATA->writeback_kb << 10;
+		struct p4_inode *inode = fh->inode;
+
+		pthread_rwlock_wrlock(&inode->lock);
+		if (size > 0 && p4_wb_add(inode, fh->fd, buf, size, offset, cap)) {
+			res = 0;
+			if (inode->wb_len >= cap)
+				res = p4_wb_flush(inode);
+			if (res == 0)
+				res = size;
+		} else {
+			res = p4_wb_flush(inode);
+			if (res == 0 && size > 0 &&
+			    p4_wb_add(inode, fh->fd, buf, size, offset, cap))
+				res = size;
+			else if (res == 0) {
+				if (size > 0)
+					p4_cache_invalidate(inode, fh->fd, offset,
+							    offset + size - 1);
+				res = encfs_pwrite(fh->fd, buf, size, offset,
+						   &inode->key);
+				if (res >= 0)
+					p4_keep_cache_note(fh->fd);
+			}
+		}
+		pthread_rwlock_unlock(&inode->lock);
+		return res;
+	}
 
-	xattr_len = getxattr(path, XATTR_FLAGS, xattr_value, 8);
-	if (xattr_len != -1 && !memcmp(xattr_value, XATTR_ENCRYPTED, 4))
-		action = DECRYPT;
+	res = pwrite(fh->fd, buf, size, offset);
+	if (res == -1)
+		res = -errno;
+	else
+		p4_keep_cache_note(fh->fd);
 
-	do_crypt(inFile, outFile, action, P4_DATA->key_phrase);
-	fclose(inFile);
+	return res;
+}
 
-	fseek(outFile, offset, SEEK_SET);
-	res = fwrite(buf, 1, size, outFile);
+#if FUSE_VERSION >= 29
+/* Plaintext files answer a read with a reference to the backing file
+   rather than its data, so libfuse can splice it straight to the kernel
+   without the bytes ever entering our buffers. Encrypted files and the
+   statistics file are read into memory through p4_read(); libfuse frees
+   the buffer. */
+static int p4_read_buf(const char *fpath, struct fuse_bufvec **bufp,
+		       size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct p4_file *fh = P4_FILE(fi);
+	struct fuse_bufvec *src;
+	struct stat st;
+	void *mem;
+	int res;
 
-	/*fd = open(path, O_WRONLY);
-	if (fd == -1)
-		return -errno;
+	src = malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL)
+		return -ENOMEM;
+	*src = FUSE_BUFVEC_INIT(size);
+
+	if (!fh->encrypted && fh->stats == NULL) {
+		/* Trim the reference to end of file, so its size is what
+		   the read returns */
+		if (fstat(fh->fd, &st) == 0) {
+			if (st.st_size <= offset)
+				src->buf[0].size = 0;
+			else if (st.st_size - offset < (off_t) size)
+				src->buf[0].size = st.st_size - offset;
+		}
+		src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		src->buf[0].fd = fh->fd;
+		src->buf[0].pos = offset;
+		*bufp = src;
+		return 0;
+	}
 
-	res = pwrite(fd, buf, size, offset);*/
-	if (res == -1)
-		res = -errno;
-	fflush(outFile);
+	mem = malloc(size);
+	if (mem == NULL) {
+		free(src);
+		return -ENOMEM;
+	}
+	res = p4_read(fpath, mem, size, offset, fi);
+	if (res < 0) {
+		free(mem);
+		free(src);
+		return res;
+	}
+	src->buf[0].mem = mem;
+	src->buf[0].size = res;
+	*bufp = src;
+	return 0;
+}
 
-	if(action == DECRYPT)
-		action = ENCRYPT;
+/* Plaintext writes are copied (or spliced, with -o splice_read) from the
+   request straight into the backing file. The cipher needs encrypted
+   data in memory, which it normally already is. */
+static int p4_write_buf(const char *fpath, struct fuse_bufvec *buf,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct p4_file *fh = P4_FILE(fi);
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	void *mem;
+	int res;
 
-	inFile = fopen(path, "w");
-	fseek(outFile, 0, SEEK_SET);
-	do_crypt(outFile, inFile, action, P4_DATA->key_phrase);
+	if (!fh->encrypted) {
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = fh->fd;
+		dst.buf[0].pos = offset;
+		res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+		if (res >= 0)
+			p4_keep_cache_note(fh->fd);
+		return res;
+	}
 
-	fclose(outFile);
-	fclose(inFile);
-	//close(fd);
+	if (buf->count == 1 && buf->idx == 0 && buf->off == 0 &&
+	    !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+		return p4_write(fpath, buf->buf[0].mem, size, offset, fi);
+
+	mem = malloc(size);
+	if (mem == NULL)
+		return -ENOMEM;
+	dst.buf[0].mem = mem;
+	res = fuse_buf_copy(&dst, buf, 0);
+	if (res >= 0)
+		res = p4_write(fpath, mem, res, offset, fi);
+	free(mem);
 	return res;
 }
+#endif /* FUSE_VERSION >= 29 */
 
 static int p4_statfs(const char *fpath, struct statvfs *stbuf)
 {
@@ -441,61 +1794,212 @@ static int p4_create(const char* fpath, mode_t mode, struct fuse_file_info* fi)
 
 	char path[PATH_MAX];
 	prependPath(path,fpath);
-	char *mtext;
-	size_t msize;
+	struct p4_inode *inode;
+	int fd;
+	int res;
+
+	/* O_EXCL has to reach the backing file: the name may have been
+	   created behind the kernel's back since its lookup. Without it
+	   the file may already be open, so it is emptied and reformatted
+	   only once its inode is locked, taking any dirty extent, cached
+	   chunks and old key of the other handles with it */
+	fd = open(path, O_CREAT | O_RDWR | (fi->flags & O_EXCL), mode);
+	if (fd == -1)
+		return -errno;
+
+	res = p4_attach(fi, fd, 1);
+	if (res < 0) {
+		close(fd);
+		return res;
+	}
+	inode = P4_FILE(fi)->inode;
+
+	pthread_rwlock_wrlock(&inode->lock);
+	p4_wb_discard(inode);
+	p4_cache_invalidate(inode, fd, 0, -1);
+	if (ftruncate(fd, 0) == -1) {
+		res = -errno;
+	} else {
+		/* Other handles may be using key, so it never goes NULL;
+		   a failed encfs_init() leaves an empty file behind */
+		inode->key.ac = &P4_DATA->ciphers[P4_DATA->new_mode];
+		res = encfs_init(fd, &inode->key);
+	}
+	pthread_rwlock_unlock(&inode->lock);
+
+	if (res == 0 && fsetxattr(fd, XATTR_FLAGS, XATTR_ENCRYPTED, 4, 0))
+		res = -errno;
+	if (res < 0) {
+		p4_detach(fi);
+		return res;
+	}
+
+	p4_inode_set_encrypted(inode, 1);
+	p4_keep_cache_note(fd);
+	return 0;
+}
 
-	(void) mode;
-    (void) fi;
+static int p4_fgetattr(const char *fpath, struct stat *stbuf,
+			struct fuse_file_info *fi)
+{
+	int res;
 
-    FILE * inFile, * outFile;
+	(void) fpath;
 
-    outFile = fopen(path, "w");
-    if (outFile == NULL)
-    	return -errno;
+	if (P4_FILE(fi)->stats != NULL) {
+		p4_stats_attr(stbuf, P4_FILE(fi)->stats_len);
+		return 0;
+	}
 
-    // open file from memory - The Heap
-	inFile = open_memstream(&mtext, &msize);
-	if (inFile == NULL)
+	res = fstat(P4_FILE(fi)->fd, stbuf);
+	if (res == -1)
 		return -errno;
 
-	do_crypt(inFile, outFile, ENCRYPT, P4_DATA->key_phrase);
-	fclose(inFile);
+	if (P4_FILE(fi)->encrypted) {
+		struct p4_inode *inode = P4_FILE(fi)->inode;
+
+		pthread_rwlock_rdlock(&inode->lock);
+		stbuf->st_size = p4_wb_size(inode,
+					    encfs_plain_size(stbuf->st_size));
+		pthread_rwlock_unlock(&inode->lock);
+	}
+
+	return 0;
+}
+
+static int p4_ftruncate(const char *fpath, off_t size,
+			 struct fuse_file_info *fi)
+{
+	struct p4_file *fh = P4_FILE(fi);
+	int res;
+
+	(void) fpath;
 
-    if(setxattr(path, XATTR_FLAGS, XATTR_ENCRYPTED, 4, 0))
+	if (fh->encrypted) {
+		pthread_rwlock_wrlock(&fh->inode->lock);
+		res = p4_wb_flush(fh->inode);
+		if (res == 0) {
+			p4_cache_invalidate(fh->inode, fh->fd, size, -1);
+			res = encfs_truncate(fh->fd, size, &fh->inode->key);
+			if (res == 0)
+				p4_keep_cache_note(fh->fd);
+		}
+		pthread_rwlock_unlock(&fh->inode->lock);
+		return res;
+	}
+
+	res = ftruncate(fh->fd, size);
+	if (res == -1)
 		return -errno;
+	p4_keep_cache_note(fh->fd);
+
+	return 0;
+}
+
+#if FUSE_VERSION >= 29
+/* Encrypted files reserve or punch out whole chunks of the backing file,
+   see encfs_fallocate(); the range's cached plaintext is dropped as for
+   a write. */
+static int p4_fallocate(const char *fpath, int mode, off_t offset,
+			off_t length, struct fuse_file_info *fi)
+{
+	struct p4_file *fh = P4_FILE(fi);
+	int res;
+
+	(void) fpath;
 
-    /*int res;
-    res = creat(path, mode);
-    if(res == -1)
+	if (fh->encrypted) {
+		pthread_rwlock_wrlock(&fh->inode->lock);
+		res = p4_wb_flush(fh->inode);
+		if (res == 0) {
+			if (length > 0)
+				p4_cache_invalidate(fh->inode, fh->fd, offset,
+						    offset + length - 1);
+			res = encfs_fallocate(fh->fd, mode, offset, length,
+					      &fh->inode->key);
+			if (res == 0)
+				p4_keep_cache_note(fh->fd);
+		}
+		pthread_rwlock_unlock(&fh->inode->lock);
+		return res;
+	}
+
+	res = fallocate(fh->fd, mode, offset, length);
+	if (res == -1)
 		return -errno;
+	p4_keep_cache_note(fh->fd);
+
+	return 0;
+}
+#endif /* FUSE_VERSION >= 29 */
 
-    close(res);*/
+/* Write out the file's buffered writes, if fi is an encrypted handle */
+static int p4_writeback(struct fuse_file_info *fi)
+{
+	struct p4_file *fh = P4_FILE(fi);
+	int res;
 
-	fclose(outFile);
+	if (!fh->encrypted)
+		return 0;
 
-    return 0;
+	pthread_rwlock_wrlock(&fh->inode->lock);
+	res = p4_wb_flush(fh->inode);
+	pthread_rwlock_unlock(&fh->inode->lock);
+	return res;
 }
 
+static int p4_flush(const char *fpath, struct fuse_file_info *fi)
+{
+	int res;
+
+	(void) fpath;
+
+	/* close() reports write-back errors, so write out first */
+	res = p4_writeback(fi);
+	if (res < 0 || P4_FILE(fi)->fd == -1)
+		return res;
+
+	/* This is called from every close on an open file, so call the
+	   close on the underlying filesystem.	But since flush may be
+	   called multiple times for an open file, this must not really
+	   close the file.  This is important if used on a network
+	   filesystem like NFS which flush the data/metadata on close() */
+	res = close(dup(P4_FILE(fi)->fd));
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
 
 static int p4_release(const char *fpath, struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	int res;
 
 	(void) fpath;
-	(void) fi;
-	return 0;
+
+	res = p4_writeback(fi);
+	p4_detach(fi);
+	return res;
 }
 
 static int p4_fsync(const char *fpath, int isdatasync,
 		     struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	int res;
 
 	(void) fpath;
-	(void) isdatasync;
-	(void) fi;
+
+	res = p4_writeback(fi);
+	if (res < 0 || P4_FILE(fi)->fd == -1)
+		return res;
+
+	if (isdatasync)
+		res = fdatasync(P4_FILE(fi)->fd);
+	else
+		res = fsync(P4_FILE(fi)->fd);
+	if (res == -1)
+		return -errno;
+
 	return 0;
 }
 
@@ -506,10 +2010,17 @@ static int p4_setxattr(const char *fpath, const char *name, const char *value,
 	char path[PATH_MAX];
 	prependPath(path,fpath);
 
-	int res = lsetxattr(path, name, value, size, flags);
+	int res;
+
+	if (p4_is_stats(fpath))
+		return -EPERM;
+
+	res = lsetxattr(path, name, value, size, flags);
 
 	if (res == -1)
 		return -errno;
+	if (strcmp(name, XATTR_FLAGS) == 0)
+		p4_attr_forget(path);
 	return 0;
 }
 
@@ -538,36 +2049,368 @@ static int p4_removexattr(const char *fpath, const char *name)
 {
 	char path[PATH_MAX];
 	prependPath(path,fpath);
-	int res = lremovexattr(path, name);
+	int res;
+
+	if (p4_is_stats(fpath))
+		return -EPERM;
+
+	res = lremovexattr(path, name);
 	if (res == -1)
 		return -errno;
+	if (strcmp(name, XATTR_FLAGS) == 0)
+		p4_attr_forget(path);
 	return 0;
 }
 #endif /* HAVE_SETXATTR */
 
+/* Count an operation that started at start and returned res, and log
+   it when tracing. Only read and write results are byte counts. */
+static void p4_account(int op, const char *path, const char *path2,
+		       uint64_t start, int res, off_t offset, size_t size)
+{
+	struct encfs_trace *trace = P4_DATA->trace;
+	size_t bytes = 0;
+
+	if ((op == ENCFS_STAT_READ || op == ENCFS_STAT_WRITE) && res > 0)
+		bytes = res;
+	encfs_stats_add(op, start, res, bytes);
+	if (trace != NULL)
+		encfs_trace_add(trace, op, path, path2, start, res, offset,
+				size);
+}
+
+/* Counted entry points: the operations table points at these, and each
+   times its call through p4_account() */
+static int p4_timed_getattr(const char *fpath, struct stat *stbuf)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_getattr(fpath, stbuf);
+
+	p4_account(ENCFS_STAT_GETATTR, fpath, NULL, start, res, 0, 0);
+	return res;
+}
+
+static int p4_timed_fgetattr(const char *fpath, struct stat *stbuf,
+			     struct fuse_file_info *fi)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_fgetattr(fpath, stbuf, fi);
+
+	p4_account(ENCFS_STAT_GETATTR, fpath, NULL, start, res, 0, 0);
+	return res;
+}
+
+static int p4_timed_readdir(const char *fpath, void *buf,
+			    fuse_fill_dir_t filler, off_t offset,
+			    struct fuse_file_info *fi)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_readdir(fpath, buf, filler, offset, fi);
+
+	p4_account(ENCFS_STAT_READDIR, fpath, NULL, start, res, offset, 0);
+	return res;
+}
+
+static int p4_timed_open(const char *fpath, struct fuse_file_info *fi)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_open(fpath, fi);
+
+	p4_account(ENCFS_STAT_OPEN, fpath, NULL, start, res, 0, fi->flags);
+	return res;
+}
+
+static int p4_timed_create(const char *fpath, mode_t mode,
+			   struct fuse_file_info *fi)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_create(fpath, mode, fi);
+
+	p4_account(ENCFS_STAT_CREATE, fpath, NULL, start, res, 0, fi->flags);
+	return res;
+}
+
+static int p4_timed_read(const char *fpath, char *buf, size_t size,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_read(fpath, buf, size, offset, fi);
+
+	p4_account(ENCFS_STAT_READ, fpath, NULL, start, res, offset, size);
+	return res;
+}
+
+static int p4_timed_write(const char *fpath, const char *buf, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_write(fpath, buf, size, offset, fi);
+
+	p4_account(ENCFS_STAT_WRITE, fpath, NULL, start, res, offset, size);
+	return res;
+}
+
+#if FUSE_VERSION >= 29
+static int p4_timed_read_buf(const char *fpath, struct fuse_bufvec **bufp,
+			     size_t size, off_t offset,
+			     struct fuse_file_info *fi)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_read_buf(fpath, bufp, size, offset, fi);
+
+	/* A spliced read's buffer is already trimmed to end of file */
+	p4_account(ENCFS_STAT_READ, fpath, NULL, start,
+		   res < 0 ? res : (int) fuse_buf_size(*bufp), offset, size);
+	return res;
+}
+
+static int p4_timed_write_buf(const char *fpath, struct fuse_bufvec *buf,
+			      off_t offset, struct fuse_file_info *fi)
+{
+	size_t size = fuse_buf_size(buf);
+	uint64_t start = encfs_stats_now();
+	int res = p4_write_buf(fpath, buf, offset, fi);
+
+	p4_account(ENCFS_STAT_WRITE, fpath, NULL, start, res, offset, size);
+	return res;
+}
+#endif
+
+static int p4_timed_flush(const char *fpath, struct fuse_file_info *fi)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_flush(fpath, fi);
+
+	p4_account(ENCFS_STAT_FLUSH, fpath, NULL, start, res, 0, 0);
+	return res;
+}
+
+static int p4_timed_release(const char *fpath, struct fuse_file_info *fi)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_release(fpath, fi);
+
+	p4_account(ENCFS_STAT_RELEASE, fpath, NULL, start, res, 0, 0);
+	return res;
+}
+
+static int p4_timed_fsync(const char *fpath, int isdatasync,
+			  struct fuse_file_info *fi)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_fsync(fpath, isdatasync, fi);
+
+	p4_account(ENCFS_STAT_FSYNC, fpath, NULL, start, res, 0, isdatasync);
+	return res;
+}
+
+static int p4_timed_truncate(const char *fpath, off_t size)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_truncate(fpath, size);
+
+	p4_account(ENCFS_STAT_TRUNCATE, fpath, NULL, start, res, size, 0);
+	return res;
+}
+
+static int p4_timed_ftruncate(const char *fpath, off_t size,
+			      struct fuse_file_info *fi)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_ftruncate(fpath, size, fi);
+
+	p4_account(ENCFS_STAT_TRUNCATE, fpath, NULL, start, res, size, 0);
+	return res;
+}
+
+#if FUSE_VERSION >= 29
+static int p4_timed_fallocate(const char *fpath, int mode, off_t offset,
+			      off_t length, struct fuse_file_info *fi)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_fallocate(fpath, mode, offset, length, fi);
+
+	p4_account(ENCFS_STAT_FALLOCATE, fpath, NULL, start, res, offset,
+		   length | (uint64_t) mode << ENCFS_TRACE_MODE_SHIFT);
+	return res;
+}
+#endif
+
+static int p4_timed_unlink(const char *fpath)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_unlink(fpath);
+
+	p4_account(ENCFS_STAT_UNLINK, fpath, NULL, start, res, 0, 0);
+	return res;
+}
+
+static int p4_timed_rename(const char *from, const char *to)
+{
+	uint64_t start = encfs_stats_now();
+	int res = p4_rename(from, to);
+
+	p4_account(ENCFS_STAT_RENAME, from, to, start, res, 0, 0);
+	return res;
+}
+
+static void *p4_init(struct fuse_conn_info *conn)
+{
+	struct p4_state *state = P4_DATA;
+	long threads = state->crypt_threads;
+
+	/* Every write costs a round trip and, for encrypted files, a lock
+	   and a chunk walk, so take writes as large as libfuse's buffer
+	   allows (max_write is capped to it) rather than a page at a time.
+	   With atomic O_TRUNC, open() truncates instead of a separate
+	   truncate() call first. Asynchronous reads let the kernel send
+	   several reads of one file at once; they share the inode lock, so
+	   the worker threads serve them in parallel (-o sync_read still
+	   turns this off).
+
+	   libfuse 2 cannot ask for the writeback cache, readdirplus or
+	   parallel directory operations; those need libfuse 3. */
+	conn->want |= conn->capable &
+		(FUSE_CAP_BIG_WRITES | FUSE_CAP_ATOMIC_O_TRUNC |
+		 FUSE_CAP_ASYNC_READ);
+	conn->max_write = P4_MAX_WRITE;
+
+#if FUSE_VERSION >= 29
+	/* Plaintext reads are answered by splicing from the backing file
+	   (see p4_read_buf()); -o no_splice_write still turns this off */
+	conn->want |= conn->capable &
+		(FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+	/* Kernel read-ahead arrives as background requests; let enough
+	   of them be in flight to keep the crypt threads busy */
+	if (conn->max_background < P4_MAX_BACKGROUND) {
+		conn->max_background = P4_MAX_BACKGROUND;
+		conn->congestion_threshold = P4_MAX_BACKGROUND * 3 / 4;
+	}
+#endif
+
+	/* Threads must be started here, after fuse_main() has daemonized.
+	   The thread running a request works on its own chunks too, so the
+	   pool gets one worker fewer than the threads asked for. */
+	if (threads == 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > 1) {
+		state->pool = encfs_pool_new(threads - 1);
+		encfs_set_pool(state->pool);
+	}
+
+	if (state->cache != NULL && state->readahead_kb > 0 &&
+	    pthread_create(&state->ra_thread, NULL, p4_readahead_worker,
+			   state) == 0)
+		state->ra_running = 1;
+
+	if (state->trace_on) {
+		state->trace = encfs_trace_new(state->logfile,
+					       P4_TRACE_RECORDS);
+		if (state->trace == NULL)
+			fprintf(state->logfile, "# trace setup failed\n");
+	}
+
+	/* SIGUSR1 only pokes a pipe; the snapshot is formatted and written
+	   on a thread of its own, where stdio is safe to use */
+	if (pipe(state->stats_pipe) == 0) {
+		fcntl(state->stats_pipe[1], F_SETFL, O_NONBLOCK);
+		if (pthread_create(&state->stats_thread, NULL,
+				   p4_stats_worker, state) == 0) {
+			struct sigaction sa;
+
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = p4_stats_signal;
+			sa.sa_flags = SA_RESTART;
+			sigemptyset(&sa.sa_mask);
+			p4_stats_wakeup = state->stats_pipe[1];
+			sigaction(SIGUSR1, &sa, NULL);
+			state->stats_running = 1;
+		} else {
+			close(state->stats_pipe[0]);
+			close(state->stats_pipe[1]);
+		}
+	}
+
+	return state;
+}
+
+static void p4_destroy(void *private_data)
+{
+	struct p4_state *state = private_data;
+	struct p4_readahead *ra;
+
+	if (state->stats_running) {
+		signal(SIGUSR1, SIG_IGN);
+		p4_stats_wakeup = -1;
+		close(state->stats_pipe[1]);
+		pthread_join(state->stats_thread, NULL);
+		close(state->stats_pipe[0]);
+		state->stats_running = 0;
+	}
+
+	/* Requests are over, so nothing can be adding records */
+	encfs_trace_free(state->trace);
+	state->trace = NULL;
+
+	if (!state->ra_running)
+		goto out_pool;
+
+	pthread_mutex_lock(&state->ra_lock);
+	state->ra_stop = 1;
+	pthread_cond_broadcast(&state->ra_cond);
+	pthread_mutex_unlock(&state->ra_lock);
+	pthread_join(state->ra_thread, NULL);
+	state->ra_running = 0;
+
+	while ((ra = state->ra_head) != NULL) {
+		state->ra_head = ra->next;
+		p4_inode_put(state, ra->inode);
+		close(ra->fd);
+		free(ra);
+	}
+
+out_pool:
+	encfs_set_pool(NULL);
+	encfs_pool_free(state->pool);
+	state->pool = NULL;
+}
+
 static struct fuse_operations p4_oper = {
-	.getattr	= p4_getattr,
+	.init		= p4_init,
+	.destroy	= p4_destroy,
+	.getattr	= p4_timed_getattr,
 	.access		= p4_access,
 	.readlink	= p4_readlink,
-	.readdir	= p4_readdir,
+	.opendir	= p4_opendir,
+	.readdir	= p4_timed_readdir,
+	.releasedir	= p4_releasedir,
 	.mknod		= p4_mknod,
 	.mkdir		= p4_mkdir,
 	.symlink	= p4_symlink,
-	.unlink		= p4_unlink,
+	.unlink		= p4_timed_unlink,
 	.rmdir		= p4_rmdir,
-	.rename		= p4_rename,
+	.rename		= p4_timed_rename,
 	.link		= p4_link,
 	.chmod		= p4_chmod,
 	.chown		= p4_chown,
-	.truncate	= p4_truncate,
+	.truncate	= p4_timed_truncate,
 	.utimens	= p4_utimens,
-	.open		= p4_open,
-	.read		= p4_read,
-	.write		= p4_write,
+	.open		= p4_timed_open,
+	.read		= p4_timed_read,
+	.write		= p4_timed_write,
 	.statfs		= p4_statfs,
-	.create         = p4_create,
-	.release	= p4_release,
-	.fsync		= p4_fsync,
+	.create         = p4_timed_create,
+	.fgetattr	= p4_timed_fgetattr,
+	.ftruncate	= p4_timed_ftruncate,
+	.flush		= p4_timed_flush,
+	.release	= p4_timed_release,
+	.fsync		= p4_timed_fsync,
+#if FUSE_VERSION >= 29
+	.read_buf	= p4_timed_read_buf,
+	.write_buf	= p4_timed_write_buf,
+	.fallocate	= p4_timed_fallocate,
+#endif
 #ifdef HAVE_SETXATTR
 	.setxattr	= p4_setxattr,
 	.getxattr	= p4_getxattr,
@@ -578,7 +2421,18 @@ static struct fuse_operations p4_oper = {
 
 void p4_usage()
 {
-    fprintf(stderr, "usage:  p4fs [FUSE and mount options] rootDir mountPoint\n");
+    fprintf(stderr, "usage:  p4fs [FUSE and mount options] keyPhrase rootDir mountPoint\n");
+    fprintf(stderr, "p4fs options:\n");
+    fprintf(stderr, "    -o cache_size=N        MiB of decrypted chunks to cache (default %d, 0 disables)\n", P4_CACHE_MB);
+    fprintf(stderr, "    -o readahead=N         max KiB decrypted ahead of sequential readers (default %d, 0 disables)\n", P4_READAHEAD_KB);
+    fprintf(stderr, "    -o writeback=N         KiB of small writes buffered per file before encrypting (default %d, 0 disables)\n", P4_WRITEBACK_KB);
+    fprintf(stderr, "    -o crypt_threads=N     threads sharing the cipher work of large requests (default one per CPU)\n");
+    fprintf(stderr, "    -o cipher=NAME         cipher for new files: gcm, ctr, xts or chacha20-poly1305\n");
+    fprintf(stderr, "                           (default gcm with AES instructions, chacha20-poly1305 without)\n");
+    fprintf(stderr, "    -o logfile=PATH        append the /.encfs-stats snapshot here on SIGUSR1 (default stderr)\n");
+    fprintf(stderr, "    -o trace               log every operation to the logfile (see encfs-trace.h)\n");
+    fprintf(stderr, "    -o cache_timeout=N     seconds the kernel caches names and attributes (default %d);\n", P4_CACHE_TIMEOUT);
+    fprintf(stderr, "                           raise it when nothing else writes to rootDir\n");
     abort();
 }
 
@@ -586,15 +2440,23 @@ int main(int argc, char *argv[])
 {
 	umask(0);
 	int fuse_stat;
+	int hw_aes;
+	int i;
+	char cache_opts[128];
 	struct p4_state *p4_data;
 
-	p4_data = malloc(sizeof(struct p4_state));
+	p4_data = calloc(1, sizeof(struct p4_state));
 
 	if (p4_data == NULL) {
 		perror("main calloc");
 		abort();
 	}
 
+	pthread_mutex_init(&p4_data->inodes_lock, NULL);
+	pthread_mutex_init(&p4_data->attrs_lock, NULL);
+	pthread_mutex_init(&p4_data->ra_lock, NULL);
+	pthread_cond_init(&p4_data->ra_cond, NULL);
+	p4_data->ra_tail = &p4_data->ra_head;
 	p4_data->key_phrase = argv[argc-3];
 	p4_data->rootdir = realpath(argv[argc-2], NULL);
 	
@@ -602,6 +2464,7 @@ int main(int argc, char *argv[])
 	argv[argc-2] = NULL;
     argv[argc-1] = NULL;
     argc-=2;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	if (p4_data->rootdir == NULL)
 	{
@@ -609,8 +2472,92 @@ int main(int argc, char *argv[])
 		abort();
 	}
 
+	p4_data->cache_mb = P4_CACHE_MB;
+	p4_data->readahead_kb = P4_READAHEAD_KB;
+	p4_data->writeback_kb = P4_WRITEBACK_KB;
+	p4_data->cache_timeout = P4_CACHE_TIMEOUT;
+	if (fuse_opt_parse(&args, p4_data, p4_opts, NULL) == -1)
+		p4_usage();
+
+	/* Every change made through the mount already updates the kernel's
+	   caches, so the timeouts only bound how long the kernel's names
+	   and attributes lag changes made to the backing files directly;
+	   the chunk cache does not expire with them. p4_open() decides
+	   whether page data is kept across opens. Inserted first, so an
+	   explicit -o attr_timeout etc. still wins. */
+	snprintf(cache_opts, sizeof(cache_opts),
+		 "-oentry_timeout=%lu,attr_timeout=%lu,"
+		 "negative_timeout=%lu", p4_data->cache_timeout,
+		 p4_data->cache_timeout, p4_data->cache_timeout);
+	if (fuse_opt_insert_arg(&args, 1, cache_opts) == -1)
+		p4_usage();
+
+	/* GCM is fastest with AES instructions; ChaCha20-Poly1305 beats
+	   software AES on CPUs without them */
+	hw_aes = aes_crypt_hw_aes();
+	if (p4_data->cipher_name != NULL)
+		p4_data->new_mode = aes_crypt_mode(p4_data->cipher_name);
+	else if (hw_aes == 0)
+		p4_data->new_mode = AES_CRYPT_CHACHA20_POLY1305;
+	else
+		p4_data->new_mode = AES_CRYPT_GCM;
+	if (p4_data->new_mode < 0)
+		p4_usage();
 
+	if (p4_data->trace_on && p4_data->logfile_name == NULL) {
+		fprintf(stderr, "-o trace needs -o logfile\n");
+		p4_usage();
+	}
 
-	fuse_stat = fuse_main(argc, argv, &p4_oper, p4_data);
+	/* Opened before fuse_main() daemonizes and changes directory */
+	if (p4_data->logfile_name != NULL) {
+		p4_data->logfile = fopen(p4_data->logfile_name, "a");
+		if (p4_data->logfile == NULL) {
+			perror("logfile");
+			abort();
+		}
+	}
+
+	/* Derive the keys once here rather than on every read and write.
+	   Existing files keep whatever cipher they were written with, so
+	   every mode is set up; only the one for new files must work. */
+	for (i = 0; i < AES_CRYPT_NMODES; i++) {
+		if (!aes_crypt_init(&p4_data->ciphers[i], p4_data->key_phrase, i)) {
+			if (i == p4_data->new_mode) {
+				fprintf(stderr, "cipher setup fail\n");
+				abort();
+			}
+			fprintf(stderr, "cipher %d unavailable, files using it will fail with EIO\n", i);
+		}
+	}
+	fprintf(stderr, "pa4-encfs: new files use %s (%s)\n",
+		p4_data->ciphers[p4_data->new_mode].name,
+		hw_aes == 1 ? "AES instructions available" :
+		hw_aes == 0 ? "no AES instructions" :
+		"AES instructions unknown");
+
+	if (p4_data->cache_mb > 0) {
+		p4_data->cache = encfs_cache_new(p4_data->cache_mb << 20);
+		if (p4_data->cache == NULL) {
+			fprintf(stderr, "cache setup fail\n");
+			abort();
+		}
+	}
+
+	fuse_stat = fuse_main(args.argc, args.argv, &p4_oper, p4_data);
+
+	if (p4_data->cache != NULL) {
+		struct encfs_cache_stats stats;
+
+		encfs_cache_get_stats(p4_data->cache, &stats);
+		fprintf(stderr, "chunk cache: %lu hits, %lu misses, %lu evictions\n",
+			stats.hits, stats.misses, stats.evictions);
+		encfs_cache_free(p4_data->cache);
+	}
+	fuse_opt_free_args(&args);
+	for (i = 0; i < AES_CRYPT_NMODES; i++)
+		aes_crypt_cleanup(&p4_data->ciphers[i]);
+	if (p4_data->logfile != NULL)
+		fclose(p4_data->logfile);
 	return fuse_stat;
 }
\ No newline at end of file